@@ -11,7 +11,11 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
 
 #include "log.h"
 #include "mem.h"
@@ -28,9 +32,26 @@
 # define cp_debug(_args...) while(0) {_debug(__func__, __LINE__, _args);}
 #endif
 
+/*
+ * The files of all sizes with more than one file, grouped by size into two
+ * contiguous arrays of sizes and record pointers.  Shared by the compare
+ * work items, each of which takes a range of whole sizes.  The last one to
+ * finish frees it.
+ */
+
+struct compare_candidates {
+	unsigned int refs;
+	unsigned int count;
+	uint64_t *sizes;
+	struct file_data **files;
+};
+
 struct compare_files_cb_data {
-	const struct list *ht_list;
+	struct compare_candidates *cands;
+	unsigned int start;
+	unsigned int count;
 	bool (*check_for_signals)(void);
+	const struct compare_opts *co;
 	struct compare_file_pointers *fps;
 };
 
@@ -39,235 +60,973 @@ struct dupe_buffer {
 	size_t len;
 };
 
+/* Paths are rebuilt from the directory nodes straight into the buffer. */
+
 static void dupe_buffer_write_first(struct dupe_buffer* db,
 	struct file_data *data_1)
 {
 	static const char prefix[] = {'[', '1', ']', ' '};
+	size_t path_len = file_data_path_len(data_1);
 
-	db->buf = realloc(db->buf, db->len + sizeof(prefix) + data_1->name_len
-		+ 1);
+	db->buf = realloc(db->buf, db->len + sizeof(prefix) + path_len + 1);
 
 	memcpy(db->buf + db->len, prefix, sizeof(prefix));
-	memcpy(db->buf + db->len + sizeof(prefix), data_1->name,
-		data_1->name_len);
+	file_data_path(data_1, db->buf + db->len + sizeof(prefix));
 
-	*(db->buf + db->len + sizeof(prefix) + data_1->name_len) = '\n';
+	*(db->buf + db->len + sizeof(prefix) + path_len) = '\n';
 
-	db->len += sizeof(prefix) + data_1->name_len + 1;
+	db->len += sizeof(prefix) + path_len + 1;
 }
 
 static void dupe_buffer_write_match(struct dupe_buffer* db,
 	struct file_data *data_2, unsigned int match_counter)
 {
 	static const unsigned int prefix_len = sizeof("[4294967295] ") - 1;
+	size_t path_len = file_data_path_len(data_2);
 
-	db->buf = realloc(db->buf, db->len + prefix_len + data_2->name_len + 2);
+	db->buf = realloc(db->buf, db->len + prefix_len + path_len + 2);
 
-	db->len += sprintf(db->buf + db->len, "[%u] %s\n", match_counter + 1,
-		data_2->name);
+	db->len += sprintf(db->buf + db->len, "[%u] ", match_counter + 1);
+	file_data_path(data_2, db->buf + db->len);
+	db->len += path_len;
+	*(db->buf + db->len) = '\n';
+	db->len++;
 }
 
-static int compare_files_cb(struct work_item *wi)
+static void dupe_buffer_flush(struct dupe_buffer* db, FILE *fp)
 {
-	struct compare_files_cb_data *cbd = wi->cb_data;
-	struct hash_table_entry *hte_1;
-	struct hash_table_entry *hte_safe;
-	struct compare_counts *compare_result = wi->result;
-	int result = 0;
+	size_t result;
+
+	assert(db->buf);
+	*(db->buf + db->len) = '\n';
+	db->len++;
+
+	result = fwrite(db->buf, 1, db->len, fp);
+
+	if (result != db->len) {
+		log("ERROR: fwrite failed: %s\n", strerror(errno));
+		assert(0);
+		exit(EXIT_FAILURE);
+	}
+
+	free(db->buf);
+	db->buf = NULL;
+	db->len = 0;
+}
+
+/* Opens the file, leaving its path in path for error messages. */
+
+static int compare_open_file(const struct file_data *data, char *path)
+{
+	int fd;
+
+	fd = open(file_data_path(data, path), O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		log("ERROR: open '%s' failed: %s\n", path,
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	return fd;
+}
+
+static bool compare_load_xattr(struct file_data *data)
+{
+	char path[file_path_max];
+	bool loaded;
+	int fd;
+
+	fd = compare_open_file(data, path);
+	loaded = digest_xattr_load(fd, data->size, data->mtime_ns,
+		&data->digest);
+	close(fd);
+
+	return loaded;
+}
+
+/*
+ * Writing the xattr changes the file's ctime, so the ctime is read again
+ * for the digest cache key.  Otherwise the cache entry would never match
+ * the file on the next run.
+ */
+
+static void compare_hash_file_xattr(struct file_data *data)
+{
+	char path[file_path_max];
+	struct stat st;
+	int fd;
+
+	fd = compare_open_file(data, path);
+
+	digest_hash_fd(&data->digest, fd, path);
+	digest_xattr_store(fd, data->size, data->mtime_ns, &data->digest);
+
+	if (!fstat(fd, &st)) {
+		data->ctime_ns = st.st_ctim.tv_sec * 1000000000ULL
+			+ st.st_ctim.tv_nsec;
+	}
+
+	close(fd);
+}
+
+static void compare_cache_key(const struct file_data *data,
+	struct digest_cache_key *key)
+{
+	*key = (struct digest_cache_key) {
+		.dev = data->dev,
+		.ino = data->ino,
+		.size = data->size,
+		.mtime_ns = data->mtime_ns,
+		.ctime_ns = data->ctime_ns,
+	};
+}
+
+/*
+ * Returns true if the digest of a file is known without reading its data,
+ * from an earlier comparison, the digest cache or the file's digest xattr.
+ * This is checked before any prefix or suffix read.
+ */
+
+static bool compare_lookup_digest(const struct compare_opts *co,
+	struct file_data *data)
+{
+	struct digest_cache_key key;
+
+	if (!digest_is_empty(&data->digest)) {
+		return true;
+	}
+
+	if (data->cache_checked) {
+		return false;
+	}
+
+	data->cache_checked = true;
+
+	if (co->cache) {
+		compare_cache_key(data, &key);
+
+		if (digest_cache_lookup(co->cache, &key, &data->digest)) {
+			return true;
+		}
+	}
+
+	return co->xattr && compare_load_xattr(data);
+}
+
+/*
+ * Fill in the digest of a file, from the digest cache or the file's digest
+ * xattr when they have a valid entry for the file.  Returns the number of
+ * bytes hashed.
+ */
+
+static uint64_t compare_hash_file(const struct compare_opts *co,
+	struct file_data *data)
+{
+	struct digest_cache_key key;
+	char path[file_path_max];
+
+	if (compare_lookup_digest(co, data)) {
+		return 0;
+	}
+
+	if (co->xattr) {
+		compare_hash_file_xattr(data);
+	} else {
+		digest_hash_file(&data->digest, file_data_path(data, path));
+	}
+
+	if (co->cache) {
+		compare_cache_key(data, &key);
+		digest_cache_insert(co->cache, &key,
+			file_data_path(data, path), &data->digest);
+	}
+
+	return data->size;
+}
+
+static uint64_t compare_hash_range(const struct file_data *data,
+	uint64_t offset, size_t len)
+{
+	char path[file_path_max];
+	struct digest digest;
+	int fd;
+
+	fd = compare_open_file(data, path);
+
+	digest_init(&digest);
+	digest_hash_range(&digest, fd, offset, len, path);
+
+	close(fd);
+	return digest.data[0] ^ digest.data[1];
+}
+
+static void compare_hash_prefix(unsigned int prefix_size,
+	struct compare_counts *counts, struct file_data *data)
+{
+	if (data->prefix_done) {
+		return;
+	}
+
+	data->prefix_hash = compare_hash_range(data, 0, prefix_size);
+	data->prefix_done = true;
+	counts->prefix_bytes += prefix_size;
+}
+
+static void compare_hash_suffix(struct compare_counts *counts,
+	struct file_data *data)
+{
+	if (data->suffix_done) {
+		return;
+	}
+
+	data->suffix_hash = compare_hash_range(data,
+		data->size - compare_suffix_size, compare_suffix_size);
+	data->suffix_done = true;
+	counts->suffix_bytes += compare_suffix_size;
+}
+
+/*
+ * The entries of a work item are grouped by sorting them on a key, which is
+ * first the file size, then the prefix hash, suffix hash and digest within
+ * each run of equal keys.  Ties are broken by insertion position so groups
+ * come out in the order the files were found.
+ */
+
+struct compare_entry {
+	uint64_t key[4];
+	unsigned int index;
+	unsigned int group;
+	struct file_data *data;
+};
+
+enum compare_stage {
+	compare_stage_prefix,
+	compare_stage_suffix,
+	compare_stage_digest,
+};
+
+static inline struct file_data *compare_entry_data(
+	const struct compare_entry *entry)
+{
+	return entry->data;
+}
+
+static inline void compare_entry_set_key(struct compare_entry *entry,
+	uint64_t key_0, uint64_t key_1)
+{
+	entry->key[0] = key_0;
+	entry->key[1] = key_1;
+	entry->key[2] = entry->key[3] = 0;
+}
+
+static int compare_entry_cmp(const void *a, const void *b)
+{
+	const struct compare_entry *e1 = a;
+	const struct compare_entry *e2 = b;
 	unsigned int i;
 
-	if (cbd->check_for_signals()) {
-		result = -1;
-		goto exit;
+	for (i = 0; i < 4; i++) {
+		if (e1->key[i] != e2->key[i]) {
+			return e1->key[i] < e2->key[i] ? -1 : 1;
+		}
+	}
+	return e1->index < e2->index ? -1 : (e1->index > e2->index);
+}
+
+/*
+ * Account for the bytes of files that were ruled out by the prefix or suffix
+ * stage and never needed a full digest.
+ */
+
+static void compare_stage_savings(const struct compare_opts *co,
+	const struct compare_entry *entries, unsigned int count,
+	struct compare_counts *counts)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		const struct file_data *data = entries[i].data;
+
+		if (!data->prefix_done || data->matched
+			|| !digest_is_empty(&data->digest)) {
+			continue;
+		}
+
+		if (data->suffix_done) {
+			counts->suffix_saved += data->size - co->prefix_size
+				- compare_suffix_size;
+		} else {
+			counts->prefix_saved += data->size - co->prefix_size;
+		}
+	}
+}
+
+static void compare_entries_sort(struct compare_entry *entries,
+	unsigned int count)
+{
+	if (count > 1) {
+		qsort(entries, count, sizeof(*entries), compare_entry_cmp);
+	}
+}
+
+static unsigned int compare_run_end(const struct compare_entry *entries,
+	unsigned int count, unsigned int start)
+{
+	unsigned int end;
+
+	for (end = start + 1; end < count; end++) {
+		if (memcmp(entries[end].key, entries[start].key,
+			sizeof(entries[start].key))) {
+			break;
+		}
+	}
+	return end;
+}
+
+static void compare_entries_set_group(struct compare_entry *entries,
+	unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		entries[i].group = entries[0].index;
 	}
+}
+
+static bool compare_digests_unknown(const struct compare_opts *co,
+	struct compare_entry *entries, unsigned int count)
+{
+	unsigned int i;
 
-	if (0) {
-		i = 1;
-		cp_debug("=== wi-%u ===\n", wi->id);
-		list_for_each(cbd->ht_list, hte_1, list_entry) {
-			struct file_data *data = (struct file_data *)hte_1->data;
-			cp_debug("wi-%u: hte-%u.%u = %p: key = %lu, %s\n",
-				wi->id, wi->id, i++, hte_1,
-				hte_1->key, data->name);
+	for (i = 0; i < count; i++) {
+		if (!compare_lookup_digest(co,
+			compare_entry_data(&entries[i]))) {
+			return true;
 		}
-		cp_debug("============\n");
 	}
+	return false;
+}
+
+static bool compare_stage_needed(const struct compare_opts *co,
+	enum compare_stage stage, uint64_t size,
+	struct compare_entry *entries, unsigned int count)
+{
+	switch (stage) {
+	case compare_stage_prefix:
+		return co->prefix_size && size > co->prefix_size
+			&& compare_digests_unknown(co, entries, count);
+	case compare_stage_suffix:
+		return co->prefix_size
+			&& size > co->prefix_size + compare_suffix_size
+			&& compare_digests_unknown(co, entries, count);
+	case compare_stage_digest:
+		return true;
+	}
+
+	assert(0);
+	return false;
+}
+
+static void compare_stage_key(const struct compare_opts *co,
+	struct compare_counts *counts, enum compare_stage stage,
+	struct compare_entry *entry)
+{
+	struct file_data *data = compare_entry_data(entry);
+
+	switch (stage) {
+	case compare_stage_prefix:
+		compare_hash_prefix(co->prefix_size, counts, data);
+		compare_entry_set_key(entry, data->prefix_hash, 0);
+		break;
+	case compare_stage_suffix:
+		compare_hash_suffix(counts, data);
+		compare_entry_set_key(entry, data->suffix_hash, 0);
+		break;
+	case compare_stage_digest:
+		if (digest_is_empty(&data->digest)) {
+			counts->digest_bytes += compare_hash_file(co, data);
+		}
+		memcpy(entry->key, data->digest.data, sizeof(entry->key));
+		break;
+	}
+}
+
+/*
+ * Large runs of same-size files have the keys of a stage computed in batches
+ * of compare_parallel_batch entries spread over the work queue, so a popular
+ * size doesn't leave all the hashing to one thread.  Each batch counts its
+ * bytes separately and the counts are summed afterwards.
+ */
+
+static const unsigned int compare_parallel_min = 64;
+static const unsigned int compare_parallel_batch = 16;
+
+struct compare_stage_job {
+	const struct compare_opts *co;
+	enum compare_stage stage;
+	struct compare_entry *entries;
+	unsigned int count;
+	struct compare_counts *counts;
+};
+
+static void compare_stage_batch(void *arg, unsigned int index)
+{
+	struct compare_stage_job *job = arg;
+	unsigned int end = (index + 1) * compare_parallel_batch;
+	unsigned int i;
+
+	if (end > job->count) {
+		end = job->count;
+	}
+
+	for (i = index * compare_parallel_batch; i < end; i++) {
+		compare_stage_key(job->co, &job->counts[index], job->stage,
+			&job->entries[i]);
+	}
+}
+
+static void compare_stage_keys_parallel(const struct compare_opts *co,
+	struct compare_counts *counts, enum compare_stage stage,
+	struct compare_entry *entries, unsigned int count)
+{
+	unsigned int batches = (count + compare_parallel_batch - 1)
+		/ compare_parallel_batch;
+	struct compare_stage_job job = {
+		.co = co,
+		.stage = stage,
+		.entries = entries,
+		.count = count,
+	};
+	unsigned int i;
+
+	job.counts = mem_alloc_zero(batches * sizeof(job.counts[0]));
+
+	work_queue_parallel_for(batches, compare_stage_batch, &job);
 
-	list_for_each(cbd->ht_list, hte_1, list_entry) {
-		struct hash_table_entry *hte_2;
-		unsigned int match_counter = 0;
+	for (i = 0; i < batches; i++) {
+		counts->prefix_bytes += job.counts[i].prefix_bytes;
+		counts->suffix_bytes += job.counts[i].suffix_bytes;
+		counts->digest_bytes += job.counts[i].digest_bytes;
+	}
+
+	mem_free(job.counts);
+}
+
+/*
+ * Split a run of same-size files into groups of identical files.  Each stage
+ * that applies re-sorts the run on its key, and only sub-runs with more than
+ * one file go on to the next, more expensive, stage.
+ */
+
+static void compare_group_files(const struct compare_opts *co,
+	struct compare_counts *counts, enum compare_stage stage,
+	struct compare_entry *entries, unsigned int count)
+{
+	uint64_t size = compare_entry_data(&entries[0])->size;
+	unsigned int start;
+	unsigned int i;
+
+	if (count == 1) {
+		return;
+	}
+
+	while (!compare_stage_needed(co, stage, size, entries, count)) {
+		stage++;
+	}
+
+	if (count >= compare_parallel_min) {
+		compare_stage_keys_parallel(co, counts, stage, entries, count);
+	} else {
+		for (i = 0; i < count; i++) {
+			compare_stage_key(co, counts, stage, &entries[i]);
+		}
+	}
+
+	compare_entries_sort(entries, count);
+
+	for (start = 0; start < count; ) {
+		unsigned int end = compare_run_end(entries, count, start);
+
+		if (stage == compare_stage_digest) {
+			compare_entries_set_group(&entries[start], end - start);
+		} else {
+			compare_group_files(co, counts, stage + 1,
+				&entries[start], end - start);
+		}
+		start = end;
+	}
+}
+
+/*
+ * Write out the groups of a list of entries sorted by group.  Members other
+ * than the first of each group are marked as matched.  Returns the number of
+ * matched entries.
+ */
+
+static unsigned int compare_write_groups(struct work_item *wi,
+	struct compare_entry *entries, unsigned int count, FILE *fp,
+	bool hard_links)
+{
+	struct compare_files_cb_data *cbd = wi->cb_data;
+	struct compare_counts *compare_result = wi->result;
+	unsigned int matched = 0;
+	unsigned int start;
+
+	for (start = 0; start < count; ) {
+		unsigned int end = compare_run_end(entries, count, start);
+		struct file_data *data_1 = compare_entry_data(&entries[start]);
+		char path[file_path_max];
 		struct dupe_buffer d_buf = {
 			.buf = NULL,
 			.len = 0,
 		};
-		struct file_data *data_1;
+		unsigned int i;
+
+		if (end - start == 1) {
+			if (!hard_links) {
+				file_data_path(data_1, path);
+				if (get_verbosity() > 1) {
+					log("wi-%u: found unique %s\n", wi->id,
+						path);
+				}
+				compare_result->unique++;
+				fprintf(cbd->fps->unique, "%s\n", path);
+			}
+			start = end;
+			continue;
+		}
 
-		compare_result->total++;
+		dupe_buffer_write_first(&d_buf, data_1);
 
-		data_1 = (struct file_data *)hte_1->data;
+		for (i = start + 1; i < end; i++) {
+			struct file_data *data_2 =
+				compare_entry_data(&entries[i]);
 
-		if (data_1->matched) {
-			cp_debug("wi-%u: skipping:    hte-%u.1,   key = %lu, %s\n",
-				wi->id, wi->id, hte_1->key, data_1->name);
-			continue;
+			cp_debug("wi-%u: match: %s => %s\n", wi->id,
+				data_2->name, data_1->name);
+
+			data_2->matched = true;
+			dupe_buffer_write_match(&d_buf, data_2, i - start);
 		}
 
-		cp_debug("wi-%u: checking:    hte-%u.1,   key = %lu, %s\n",
-			wi->id, wi->id, hte_1->key, data_1->name);
+		if (get_verbosity()) {
+			log("wi-%u: found %u %s: %s\n", wi->id, end - start - 1,
+				hard_links ? "hard links" : "dupes",
+				file_data_path(data_1, path));
+		}
 
-		i = 0;
-		hte_2 = hte_1;
-		list_for_each_continue(cbd->ht_list, hte_2, list_entry) {
-			struct file_data *data_2;
+		matched += end - start - 1;
+		dupe_buffer_flush(&d_buf, fp);
+		start = end;
+	}
 
-			i++;
-			data_2 = (struct file_data *)hte_2->data;
+	return matched;
+}
 
-// 			cp_debug("wi-%u: test:        hte-%u.2.%u, key = %lu, %s\n",
-// 				wi->id, wi->id, i, hte_2->key, data_2->name);
+static void compare_entries_by_group(struct compare_entry *entries,
+	unsigned int count)
+{
+	unsigned int i;
 
-			if (data_2->matched) {
-				cp_debug("wi-%u: skipping:    hte-%u.2.%u, key = %lu, %s\n",
-					wi->id, wi->id, i, hte_2->key, data_2->name);
-				continue;
-			}
+	for (i = 0; i < count; i++) {
+		compare_entry_set_key(&entries[i], entries[i].group, 0);
+	}
+	compare_entries_sort(entries, count);
+}
 
-			if (hte_1->key != hte_2->key) {
-				cp_debug("wi-%u: keys differ: hte-%u.2.%u, key = %lu, %s\n",
-					wi->id, wi->id, i, hte_2->key, data_2->name);
-				continue;
-			}
+/*
+ * Files that are hard links to the same inode are collapsed into the first
+ * entry found, so only that one is hashed and reported as unique or dupe.
+ * The others are written to the hard links list and dropped from entries.
+ * Returns the number of entries left.
+ */
 
-			if (get_verbosity() > 2) {
-				log("wi-%u: keys match:  hte-%u.2.%u, key = %lu, %s\n",
-				wi->id, wi->id, i, hte_2->key, data_2->name);
-			}
+static unsigned int compare_hard_links(struct work_item *wi,
+	struct compare_entry *entries, unsigned int count)
+{
+	struct compare_files_cb_data *cbd = wi->cb_data;
+	struct compare_counts *compare_result = wi->result;
+	unsigned int start;
+	unsigned int i;
+	unsigned int j;
 
-			if (digest_is_empty(&data_1->digest)) {
-				cp_debug("wi-%u: no sum:      hte-%u.1,  key = %lu, %s\n",
-					wi->id, wi->id, hte_1->key, data_1->name);
-				digest_hash_file(&data_1->digest, data_1->name);
-			} else {
-				cp_debug("wi-%u: have sum:      hte-%u.1, key = %lu, %s\n",
-					wi->id, wi->id, hte_1->key, data_1->name);
-			}
+	for (i = 0; i < count; i++) {
+		if (compare_entry_data(&entries[i])->nlink > 1) {
+			break;
+		}
+	}
 
-			if (digest_is_empty(&data_2->digest)) {
-				cp_debug("wi-%u: no sum:      hte-%u.2.%u, key = %lu, %s\n",
-					wi->id, wi->id, i, hte_2->key, data_2->name);
-				digest_hash_file(&data_2->digest, data_2->name);
-			} else {
-				cp_debug("wi-%u: have sum:   hte-%u.2.%u, key = %lu, %s\n",
-					wi->id, wi->id, i, hte_2->key, data_2->name);
-			}
+	if (i == count) {
+		return count;
+	}
 
-			if (digest_compare(&data_1->digest, &data_2->digest)) {
-				if (get_verbosity() > 2) {
-					log("wi-%u: sums match:  hte-%u.2.%u, key = %lu, %s => %s\n",
-						wi->id, wi->id, i, hte_2->key,
-						data_2->name, data_1->name);
-				}
+	for (i = 0; i < count; i++) {
+		struct file_data *data = compare_entry_data(&entries[i]);
+
+		compare_entry_set_key(&entries[i], data->dev,
+			data->nlink > 1 ? data->ino : 0);
+	}
 
-				data_2->matched = true;
-				match_counter++;
+	compare_entries_sort(entries, count);
 
-				if (match_counter == 1) {
-					dupe_buffer_write_first(&d_buf, data_1);
-				}
-				dupe_buffer_write_match(&d_buf, data_2,
-					match_counter);
-			} else {
-				cp_debug("wi-%u: sums differ: %s = %s\n",
-					wi->id, data_1->name ,data_2->name);
+	for (start = 0; start < count; ) {
+		unsigned int end = compare_run_end(entries, count, start);
+
+		for (i = start; i < end; i++) {
+			if (entries[start].key[1]) {
+				entries[i].group = entries[start].index;
 			}
 		}
+		start = end;
+	}
+
+	compare_entries_by_group(entries, count);
+	compare_result->hard_links += compare_write_groups(wi, entries, count,
+		cbd->fps->hard_links, true);
+
+	for (i = 0, j = 0; i < count; i++) {
+		if (!compare_entry_data(&entries[i])->matched) {
+			entries[j++] = entries[i];
+		}
+	}
+
+	return j;
+}
+
+static void compare_candidates_put(struct compare_candidates *cands)
+{
+	if (__atomic_sub_fetch(&cands->refs, 1, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+
+	mem_free(cands->sizes);
+	mem_free(cands->files);
+	mem_free(cands);
+}
+
+static void compare_files_clean(const struct compare_files_cb_data *cbd)
+{
+	unsigned int i;
+
+	for (i = cbd->start; i < cbd->start + cbd->count; i++) {
+		file_data_free(cbd->cands->files[i]);
+	}
+	compare_candidates_put(cbd->cands);
+}
+
+static int compare_files_cb(struct work_item *wi)
+{
+	struct compare_files_cb_data *cbd = wi->cb_data;
+	struct compare_counts *compare_result = wi->result;
+	struct compare_entry *entries;
+	unsigned int count = cbd->count;
+	unsigned int start;
+	unsigned int i;
+	int result = 0;
+
+	if (cbd->check_for_signals()) {
+		result = -1;
+		goto exit;
+	}
+
+	entries = mem_alloc(count * sizeof(*entries));
+
+	for (i = 0; i < count; i++) {
+		entries[i] = (struct compare_entry) {
+			.key = {cbd->cands->sizes[cbd->start + i], 0, 0, 0},
+			.index = i,
+			.group = i,
+			.data = cbd->cands->files[cbd->start + i],
+		};
+	}
+
+	compare_result->total += count;
+
+	count = compare_hard_links(wi, entries, count);
+
+	/*
+	 * The range is grouped by size and the hard link pass keeps the order,
+	 * so each size is already one run.
+	 */
+
+	for (i = 0; i < count; i++) {
+		compare_entry_set_key(&entries[i],
+			compare_entry_data(&entries[i])->size, 0);
+	}
+
+	for (start = 0; start < count; ) {
+		unsigned int end = compare_run_end(entries, count, start);
 
 		if (cbd->check_for_signals()) {
-			//cp_debug("exit on signal\n");
+			mem_free(entries);
 			result = -1;
 			goto exit;
 		}
 
-		if (match_counter) {
-			size_t result;
+		cp_debug("wi-%u: size %lu: %u files\n", wi->id,
+			compare_entry_data(&entries[start])->size,
+			end - start);
+
+		compare_group_files(cbd->co, compare_result,
+			compare_stage_prefix, &entries[start], end - start);
+		start = end;
+	}
+
+	compare_entries_by_group(entries, count);
+	compare_result->dupes += compare_write_groups(wi, entries, count,
+		cbd->fps->dupes, false);
+
+	compare_stage_savings(cbd->co, entries, count, compare_result);
+
+	mem_free(entries);
+
+exit:
+	compare_files_clean(cbd);
+	work_queue_finish_item(wi);
+	cp_debug("wi-%u: done.\n", wi->id);
+	return result;
+}
+
+static struct work_item *compare_work_alloc(
+	bool (*check_for_signals)(void), const struct compare_opts *co,
+	struct compare_file_pointers *fps,
+	struct compare_files_cb_data **cbd)
+{
+	struct work_item *wi;
+
+	wi = mem_alloc_zero(sizeof(*wi) + sizeof(**cbd)
+		+ sizeof(struct compare_counts));
+
+	*cbd = wi->cb_data = (void*)(wi + 1);
+	(*cbd)->fps = fps;
+	(*cbd)->co = co;
+	(*cbd)->check_for_signals = check_for_signals;
+
+	wi->result = (void*)(*cbd + 1);
+
+	return wi;
+}
+
+struct compare_compact_cb_data {
+	struct hash_table *ht;
+	bool (*check_for_signals)(void);
+	const struct compare_opts *co;
+	struct compare_file_pointers *fps;
+};
+
+/*
+ * Gather the files of every size with more than one file from the size
+ * index.  Sizes with a single file are unique without reading them, so
+ * they are written out here.  Their records come from the file arena, so
+ * freeing them returns no memory until the arena is released at exit.  The
+ * empty files, at size zero, are left for the caller.
+ */
+
+static struct compare_candidates *compare_compact(struct work_item *wi,
+	const struct compare_compact_cb_data *cbd)
+{
+	struct compare_counts *compare_result = wi->result;
+	struct compare_candidates *cands;
+	unsigned int count = 0;
+	unsigned int i;
+	unsigned int j;
+
+	for (i = 0; i < hash_table_shard_count; i++) {
+		const struct hash_table_shard *shard = &cbd->ht->shards[i];
 
-			if (get_verbosity()) {
-				log("wi-%u: found %u dupes: %s\n", wi->id,
-					match_counter, data_1->name);
+		for (j = 0; j <= shard->mask; j++) {
+			if (shard->slots[j].key && shard->slots[j].count > 1) {
+				count += shard->slots[j].count;
 			}
+		}
+	}
+
+	cands = mem_alloc_zero(sizeof(*cands));
+	cands->sizes = mem_alloc((count ? count : 1)
+		* sizeof(cands->sizes[0]));
+	cands->files = mem_alloc((count ? count : 1)
+		* sizeof(cands->files[0]));
 
-			compare_result->dupes += match_counter;
+	count = 0;
 
-			assert(d_buf.buf);
-			*(d_buf.buf + d_buf.len) = '\n';
-			d_buf.len++;
+	for (i = 0; i < hash_table_shard_count; i++) {
+		const struct hash_table_shard *shard = &cbd->ht->shards[i];
 
-			result = fwrite(d_buf.buf, 1, d_buf.len,
-				cbd->fps->dupes);
+		for (j = 0; j <= shard->mask; j++) {
+			const struct hash_table_slot *slot = &shard->slots[j];
+			void *const *values;
+			unsigned int k;
 
-			if (result != d_buf.len) {
-				log("ERROR: fwrite failed: %s\n",
-					strerror(errno));
-				assert(0);
-				exit(EXIT_FAILURE);
+			if (!slot->count || !slot->key) {
+				continue;
 			}
 
-			free(d_buf.buf);
-		} else {
-			if (get_verbosity() > 1) {
-				log("wi-%u: found unique %s\n", wi->id,
-					data_1->name);
+			values = hash_table_slot_values(slot);
+
+			if (slot->count == 1) {
+				struct file_data *data = values[0];
+				char path[file_path_max];
+
+				file_data_path(data, path);
+				if (get_verbosity() > 1) {
+					log("wi-%u: found unique %s\n",
+						wi->id, path);
+				}
+				compare_result->total++;
+				compare_result->unique++;
+				fprintf(cbd->fps->unique, "%s\n", path);
+				file_data_free(data);
+				continue;
 			}
 
-			assert(!d_buf.buf);
-			compare_result->unique++;
-			fprintf(cbd->fps->unique, "%s\n", data_1->name);
+			for (k = 0; k < slot->count; k++) {
+				cands->sizes[count] = slot->key;
+				cands->files[count] = values[k];
+				count++;
+			}
 		}
 	}
 
-exit:
-	list_for_each_safe(cbd->ht_list, hte_1, hte_safe, list_entry) {
-		file_table_entry_clean(hte_1);
+	cands->count = count;
+	return cands;
+}
+
+/*
+ * Each compare work item takes about compare_chunk_files files, rounded up
+ * to whole sizes so a size is never split between work items.
+ */
+
+static const unsigned int compare_chunk_files = 256;
+
+static int compare_compact_cb(struct work_item *wi)
+{
+	struct compare_compact_cb_data *cbd = wi->cb_data;
+	struct compare_candidates *cands;
+	unsigned int id = 1;
+	unsigned int start;
+
+	if (cbd->check_for_signals()) {
+		work_queue_finish_item(wi);
+		return -1;
 	}
+
+	cands = compare_compact(wi, cbd);
+	cands->refs = 1;
+
+	for (start = 0; start < cands->count; ) {
+		struct compare_files_cb_data *range;
+		struct work_item *range_wi;
+		unsigned int end = start + compare_chunk_files;
+
+		if (end >= cands->count) {
+			end = cands->count;
+		} else {
+			while (end < cands->count
+				&& cands->sizes[end] == cands->sizes[end - 1]) {
+				end++;
+			}
+		}
+
+		range_wi = compare_work_alloc(cbd->check_for_signals, cbd->co,
+			cbd->fps, &range);
+		range->cands = cands;
+		range->start = start;
+		range->count = end - start;
+		range_wi->id = id++;
+		range_wi->cb = compare_files_cb;
+
+		__atomic_add_fetch(&cands->refs, 1, __ATOMIC_RELAXED);
+		work_queue_add_item(wi->wq, range_wi);
+		start = end;
+	}
+
+	cp_debug("queued %u\n", id - 1);
+
+	compare_candidates_put(cands);
 	work_queue_finish_item(wi);
-	cp_debug("wi-%u: done.\n", wi->id);
-	return result;
+	return 0;
 }
 
+/*
+ * Compare runs as one compaction work item, which queues the compare work
+ * items for the candidate ranges.  The size index must be settled.
+ */
 
-static void compare_files_queue_work(unsigned int id, struct work_queue *wq,
-	bool (*check_for_signals)(void), struct compare_file_pointers *fps,
-	const struct list *ht_list)
+void compare_files(struct work_queue *wq, struct hash_table *ht,
+	bool (*check_for_signals)(void), const struct compare_opts *co,
+	struct compare_file_pointers *fps)
 {
-	struct compare_files_cb_data *cbd;
+	struct compare_compact_cb_data *cbd;
 	struct work_item *wi;
 
 	wi = mem_alloc_zero(sizeof(*wi) + sizeof(*cbd)
 		+ sizeof(struct compare_counts));
 
 	cbd = wi->cb_data = (void*)(wi + 1);
+	cbd->ht = ht;
 	cbd->fps = fps;
+	cbd->co = co;
 	cbd->check_for_signals = check_for_signals;
-	cbd->ht_list = ht_list;
 
-	wi->id = id;
-	wi->cb = compare_files_cb;
+	wi->id = 0;
+	wi->cb = compare_compact_cb;
 	wi->result = (void*)(cbd + 1);
 
-	//cp_debug("> id = %u, list = %p, %p\n", wi->id, cbd->ht_list, &wq->ready_list);
 	work_queue_add_item(wq, wi);
 }
 
-void compare_files(struct work_queue *wq, struct hash_table *ht,
-	bool (*check_for_signals)(void), struct compare_file_pointers *fps)
+/*
+ * Pipelined prefix hashing.  While the scan is still running, find queues a
+ * file here as soon as its size is shared with another file.  Only the
+ * prefix hash is taken, the grouping is left to compare_files(), which
+ * finds prefix_done set.  The work items come from the find work arena and
+ * are freed when done, the bytes hashed are summed into fo->pipeline_bytes.
+ */
+
+struct compare_prefix_cb_data {
+	bool (*check_for_signals)(void);
+	const struct find_opts *fo;
+	struct file_data *data;
+};
+
+static int compare_prefix_cb(struct work_item *wi)
 {
-	unsigned int i;
+	struct compare_prefix_cb_data *cbd = wi->cb_data;
+	struct compare_counts counts = {0};
 
-	cp_debug("ht count = %u\n", ht->count);
+	if (!cbd->check_for_signals()) {
+		compare_hash_prefix(cbd->fo->pipeline_prefix, &counts,
+			cbd->data);
+		__atomic_add_fetch(cbd->fo->pipeline_bytes,
+			counts.prefix_bytes, __ATOMIC_RELAXED);
+	}
 
-	for (i = 0; i < ht->count; i++) {
-		//cp_debug("queue list[%u]\n", i);
-		compare_files_queue_work(i, wq, check_for_signals, fps,
-			&(ht->array[i]));
+	mem_arena_free(wi);
+	return 0;
+}
+
+void compare_queue_prefix(struct work_queue *wq,
+	bool (*check_for_signals)(void), const struct find_opts *fo,
+	struct file_data *data)
+{
+	struct compare_prefix_cb_data *cbd;
+	struct work_item *wi;
+
+	if (data->size <= fo->pipeline_prefix
+		|| __atomic_exchange_n(&data->prefix_queued, true,
+			__ATOMIC_RELAXED)) {
+		return;
 	}
+
+	wi = mem_arena_alloc_zero(fo->work_arena, sizeof(*wi) + sizeof(*cbd));
+
+	cbd = wi->cb_data = (void*)(wi + 1);
+	cbd->check_for_signals = check_for_signals;
+	cbd->fo = fo;
+	cbd->data = data;
+
+	wi->cb = compare_prefix_cb;
+
+	work_queue_add_item(wq, wi);
 }
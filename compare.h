@@ -5,23 +5,47 @@
 #if !defined(_FIND_DUPES_H)
 #define _FIND_DUPES_H
 
+#include <stdint.h>
 #include <stdio.h>
 
+#include "digest-cache.h"
 #include "hash-table.h"
 #include "work-queue.h"
 
+struct file_data;
+struct find_opts;
+
 struct compare_file_pointers {
 	FILE *dupes;
 	FILE *unique;
+	FILE *hard_links;
 };
 
 struct compare_counts {
 	unsigned int total;
 	unsigned int dupes;
 	unsigned int unique;
+	unsigned int hard_links;
+	uint64_t prefix_bytes;
+	uint64_t suffix_bytes;
+	uint64_t digest_bytes;
+	uint64_t prefix_saved;
+	uint64_t suffix_saved;
+};
+
+enum {compare_suffix_size = 4096};
+
+struct compare_opts {
+	struct digest_cache *cache;
+	bool xattr;
+	unsigned int prefix_size;
 };
 
 void compare_files(struct work_queue *wq, struct hash_table *ht,
-	bool (*check_for_signals)(void), struct compare_file_pointers *fps);
+	bool (*check_for_signals)(void), const struct compare_opts *co,
+	struct compare_file_pointers *fps);
+void compare_queue_prefix(struct work_queue *wq,
+	bool (*check_for_signals)(void), const struct find_opts *fo,
+	struct file_data *data);
 
 #endif /* _FIND_DUPES_H */
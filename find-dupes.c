@@ -12,6 +12,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <signal.h>
 #include <string.h>
@@ -58,11 +59,23 @@ static void print_project_info(void)
 
 enum opt_value {opt_undef = 0, opt_yes, opt_no};
 
+/* The table size hint, 1024 * buckets, must fit an unsigned int. */
+enum {opts_buckets_max = 1024 * 1024};
+
 struct opts {
 	char *output_dir;
 	enum opt_value file_list;
 	unsigned int jobs;
 	unsigned int buckets;
+	enum opt_value bucket_stats;
+	enum opt_value no_sync;
+	enum opt_value digest_cache;
+	char *digest_cache_file;
+	enum opt_value digest_xattr;
+	unsigned int prefix_size;
+	enum opt_value pipeline;
+	enum digest_type digest;
+	enum digest_io hash_io;
 	enum opt_value help;
 	enum opt_value verbose;
 	enum opt_value debug;
@@ -79,13 +92,23 @@ static void print_usage(const struct opts *opts)
 		"  -o --output-dir - Output lists to this directory. Default: '%s'.\n"
 		"  -f --file-list  - Generate a list of all files found.\n"
 		"  -j --jobs       - Number of jobs to run in parallel. Default: '%u'.\n"
-		"  -b --buckets    - Hash bucket scale factor. Default: '%u'.\n"
+		"  -b --buckets    - Initial hash table size hint, in units of 1024 sizes, up to 1048576. Default: estimated from the filesystem.\n"
+		"  -B --bucket-stats - Print hash table occupancy statistics after the scan.\n"
+		"  -s --no-sync    - Allow cached file attributes on network filesystems.\n"
+		"  -c --digest-cache[=file] - Use a persistent digest cache. Default: '$XDG_CACHE_HOME/clean-dupes/digest.cache'.\n"
+		"  -x --digest-xattr - Keep file digests in a user extended attribute.\n"
+		"  -d --digest     - Digest type {md5 mmhash xxh128 blake3 sha256 sha512-256 blake3-tree}. Default: '%s'.\n"
+		"  -i --hash-io    - File hashing method {auto mmap read direct}. Default: '%s'.\n"
+		"  -p --prefix-size - KiB of file prefix to compare before a full digest, 4-64 or 0 to disable. Not used with -c or -x. Default: '%u'.\n"
+		"  -P --pipeline   - Start prefix hashing while the directory scan is still running.\n"
 		"  -h --help       - Show this help and exit.\n"
 		"  -v --verbose    - Verbose execution.\n"
 		"  -g --debug      - Extra verbose execution.\n"
 		"  -V --version    - Display the program version number.\n"
 		"Info:\n"
-		, opts->output_dir, opts->jobs, opts->buckets);
+		, opts->output_dir, opts->jobs,
+		digest_type_name(opts->digest), digest_io_name(opts->hash_io),
+		opts->prefix_size);
 
 	print_project_info();
 }
@@ -115,7 +138,16 @@ static void opts_init(struct opts *opts, const char *date)
 	*opts = (struct opts) {
 		.output_dir = NULL,
 		.file_list = opt_no,
-		.buckets = 1,
+		.buckets = 0,
+		.bucket_stats = opt_no,
+		.no_sync = opt_no,
+		.digest_cache = opt_no,
+		.digest_cache_file = NULL,
+		.digest_xattr = opt_no,
+		.prefix_size = 16,
+		.pipeline = opt_no,
+		.digest = digest_get_default_type(),
+		.hash_io = digest_io_auto,
 		.help = opt_no,
 		.verbose = opt_no,
 		.debug = opt_no,
@@ -134,6 +166,28 @@ static void opts_init(struct opts *opts, const char *date)
 	}	
 }
 
+/*
+ * The default digest cache lives under $XDG_CACHE_HOME, not in the output
+ * directory, whose default name changes with every run.
+ */
+
+static char *default_digest_cache_file(const struct opts *opts)
+{
+	const char *dir = getenv("XDG_CACHE_HOME");
+
+	if (dir && dir[0] == '/') {
+		return mem_strdupcat(dir, "/clean-dupes/digest.cache");
+	}
+
+	dir = getenv("HOME");
+
+	if (dir && dir[0]) {
+		return mem_strdupcat(dir, "/.cache/clean-dupes/digest.cache");
+	}
+
+	return mem_strdupcat(opts->output_dir, "/digest.cache");
+}
+
 static int opts_parse(struct opts *opts, int argc, char *argv[])
 {
 	static const struct option long_options[] = {
@@ -141,13 +195,21 @@ static int opts_parse(struct opts *opts, int argc, char *argv[])
 		{"file-list",  no_argument,       NULL, 'f'},
 		{"jobs",       required_argument, NULL, 'j'},
 		{"buckets",    required_argument, NULL, 'b'},
+		{"bucket-stats", no_argument,     NULL, 'B'},
+		{"no-sync",    no_argument,       NULL, 's'},
+		{"digest-cache", optional_argument, NULL, 'c'},
+		{"digest-xattr", no_argument,     NULL, 'x'},
+		{"digest",     required_argument, NULL, 'd'},
+		{"hash-io",    required_argument, NULL, 'i'},
+		{"prefix-size", required_argument, NULL, 'p'},
+		{"pipeline",   no_argument,       NULL, 'P'},
 		{"help",       no_argument,       NULL, 'h'},
 		{"verbose",    no_argument,       NULL, 'v'},
 		{"debug",      no_argument,       NULL, 'g'},
 		{"version",    no_argument,       NULL, 'V'},
 		{ NULL,        0,                 NULL, 0},
 	};
-	static const char short_options[] = "o:fj:b:hvgV";
+	static const char short_options[] = "o:fj:b:Bsc::xd:i:p:PhvgV";
 
 	if (1) {
 		int i;
@@ -195,11 +257,68 @@ static int opts_parse(struct opts *opts, int argc, char *argv[])
 			break;
 		case 'b':
 			opts->buckets = to_unsigned(optarg);
-			if (opts->buckets == UINT_MAX) {
+			if (opts->buckets == UINT_MAX
+				|| opts->buckets > opts_buckets_max) {
+				fprintf(stderr,
+					"find-dupes: ERROR: Bad buckets: '%s'.\n",
+					optarg);
 				opts->help = opt_yes;
 				return -1;
 			}
 			break;
+		case 'B':
+			opts->bucket_stats = opt_yes;
+			break;
+		case 's':
+			opts->no_sync = opt_yes;
+			break;
+		case 'c':
+			opts->digest_cache = opt_yes;
+			if (optarg) {
+				if (opts->digest_cache_file) {
+					mem_free(opts->digest_cache_file);
+				}
+				opts->digest_cache_file = mem_strdup(optarg);
+			}
+			break;
+		case 'x':
+			opts->digest_xattr = opt_yes;
+			break;
+		case 'd':
+			if (!digest_type_from_name(optarg, &opts->digest)
+				|| !digest_type_available(opts->digest)) {
+				fprintf(stderr,
+					"find-dupes: ERROR: Unsupported digest type: '%s'.\n",
+					optarg);
+				opts->help = opt_yes;
+				return -1;
+			}
+			break;
+		case 'i':
+			if (!digest_io_from_name(optarg, &opts->hash_io)) {
+				fprintf(stderr,
+					"find-dupes: ERROR: Unknown hash I/O method: '%s'.\n",
+					optarg);
+				opts->help = opt_yes;
+				return -1;
+			}
+			break;
+		case 'p':
+			opts->prefix_size = to_unsigned(optarg);
+			if (opts->prefix_size == UINT_MAX
+				|| (opts->prefix_size
+				&& (opts->prefix_size < 4
+				|| opts->prefix_size * 1024 > digest_range_max))) {
+				fprintf(stderr,
+					"find-dupes: ERROR: Bad prefix size: '%s'.\n",
+					optarg);
+				opts->help = opt_yes;
+				return -1;
+			}
+			break;
+		case 'P':
+			opts->pipeline = opt_yes;
+			break;
 		case 'h':
 			opts->help = opt_yes;
 			break;
@@ -222,6 +341,20 @@ static int opts_parse(struct opts *opts, int argc, char *argv[])
 		}
 	}
 
+	if (opts->digest_cache == opt_yes && !opts->digest_cache_file) {
+		opts->digest_cache_file = default_digest_cache_file(opts);
+	}
+
+	/*
+	 * Files that the prefix and suffix stages rule out never get a full
+	 * digest, so nothing could be kept for them and they would be read
+	 * again on every run.  When digests are kept, every candidate is
+	 * hashed in full instead.
+	 */
+	if (opts->digest_cache == opt_yes || opts->digest_xattr == opt_yes) {
+		opts->prefix_size = 0;
+	}
+
 	list_init(&opts->src_dir_list, "src_dir_list");
 
 	for ( ; optind < argc; optind++) {
@@ -284,6 +417,13 @@ static bool check_for_signals(void)
 	return false;
 }
 
+/*
+ * How long main() blocks in work_queue_wait() before it looks at the
+ * signal flags again.
+ */
+
+enum {wait_interval_ms = 100};
+
 static void print_file_header(FILE *fp, const char *str)
 {
 	fprintf(fp, "# %s\n# ", version_string);
@@ -308,38 +448,61 @@ static void print_result(const char *result, const struct timer *timer)
 	fprintf(stderr, "find-dupes: Done: %s, %s.\n\n", result, str);
 }
 
-static void empty_list_print(struct list *empty_list, FILE *fp, bool size)
+/* Empty files are the values stored at size zero. */
+
+static unsigned int empty_list_count(const struct hash_table *ht)
 {
-	struct hash_table_entry *hte;
+	const struct hash_table_slot *slot = hash_table_find(ht, 0);
+
+	return slot ? slot->count : 0;
+}
 
-	list_for_each(empty_list, hte, list_entry) {
-		struct file_data *data = (struct file_data *)hte->data;
+static void empty_list_print(const struct hash_table *ht, FILE *fp, bool size)
+{
+	const struct hash_table_slot *slot = hash_table_find(ht, 0);
+	char path[file_path_max];
+	void *const *values;
+	unsigned int i;
 
-		fprintf(fp, "%s%s\n", (size ? "0 " : ""), data->name);
+	if (!slot) {
+		return;
+	}
+
+	values = hash_table_slot_values(slot);
+
+	for (i = 0; i < slot->count; i++) {
+		const struct file_data *data = values[i];
+
+		fprintf(fp, "%s%s\n", (size ? "0 " : ""),
+			file_data_path(data, path));
 	}
 }
 
-static void empty_list_clean(struct list *empty_list)
+static void empty_list_clean(const struct hash_table *ht)
 {
-	struct hash_table_entry *hte;
-	struct hash_table_entry *hte_safe;
+	const struct hash_table_slot *slot = hash_table_find(ht, 0);
+	void *const *values;
+	unsigned int i;
 
-	list_for_each_safe(empty_list, hte, hte_safe, list_entry) {
-		file_table_entry_clean(hte);
+	if (!slot) {
+		return;
+	}
+
+	values = hash_table_slot_values(slot);
+
+	for (i = 0; i < slot->count; i++) {
+		file_data_free(values[i]);
 	}
 }
 
 static void compare_queue_print(struct work_queue *wq, unsigned int total_count,
-	unsigned int empty_count)
+	unsigned int empty_count, uint64_t pipeline_bytes)
 {
-	struct compare_counts totals = {0};
+	struct compare_counts totals = {.prefix_bytes = pipeline_bytes};
 	struct work_item *wi;
 
-	if (!list_is_empty(&wq->ready_list)) {
-		list_for_each(&wq->ready_list, wi, list_entry) {
-			log("ready_list: wi = %u\n", wi->id);
-		}
-		on_error("ready_list not empty.\n");
+	if (work_queue_is_busy(wq)) {
+		on_error("work queue not empty.\n");
 	}
 
 	list_for_each(&wq->done_list, wi, list_entry) {
@@ -351,13 +514,23 @@ static void compare_queue_print(struct work_queue *wq, unsigned int total_count,
 		totals.total += result->total;
 		totals.dupes += result->dupes;
 		totals.unique += result->unique;
+		totals.hard_links += result->hard_links;
+		totals.prefix_bytes += result->prefix_bytes;
+		totals.suffix_bytes += result->suffix_bytes;
+		totals.digest_bytes += result->digest_bytes;
+		totals.prefix_saved += result->prefix_saved;
+		totals.suffix_saved += result->suffix_saved;
 	}
 
 	//debug("totals.total: %u\n", totals.total);
 	//debug("total_count   %u\n", total_count);
 
-	fprintf(stderr, "find-dupes: Compared %u files. Found %u unique files, %u duplicate files, %u empty files.\n",
-		total_count, totals.unique, totals.dupes, empty_count);
+	fprintf(stderr, "find-dupes: Compared %u files. Found %u unique files, %u duplicate files, %u hard links, %u empty files.\n",
+		total_count, totals.unique, totals.dupes, totals.hard_links,
+		empty_count);
+	fprintf(stderr, "find-dupes: Hashed %" PRIu64 " prefix bytes, %" PRIu64 " suffix bytes, %" PRIu64 " digest bytes. Saved %" PRIu64 " bytes at prefix, %" PRIu64 " bytes at suffix.\n",
+		totals.prefix_bytes, totals.suffix_bytes, totals.digest_bytes,
+		totals.prefix_saved, totals.suffix_saved);
 }
 
 static void compare_queue_clean(struct work_queue *wq)
@@ -365,11 +538,8 @@ static void compare_queue_clean(struct work_queue *wq)
 	struct work_item *wi_safe;
 	struct work_item *wi;
 
-	if (!list_is_empty(&wq->ready_list)) {
-		list_for_each(&wq->ready_list, wi, list_entry) {
-			log("ready_list: wi = %u\n", wi->id);
-		}
-		on_error("ready_list not empty.\n");
+	if (work_queue_is_busy(wq)) {
+		on_error("work queue not empty.\n");
 	}
 
 	list_for_each_safe(&wq->done_list, wi, wi_safe, list_entry) {
@@ -377,30 +547,47 @@ static void compare_queue_clean(struct work_queue *wq)
 	}
 }
 
-static unsigned int get_sleep_time(unsigned int file_count)
+/*
+ * The size index grows as needed, the hint only saves the early grows.
+ * Without -b it is taken from the inode counts of the source filesystems,
+ * which overestimate for a scan of part of a filesystem, so it is capped.
+ */
+
+enum {
+	table_hint_min = 1024,
+	table_hint_max = 256 * 1024,
+};
+
+static unsigned int table_size_hint(const struct opts *opts)
 {
-	if (file_count < 15000) {
-		return 1;
-	}
-	if (file_count < 50000) {
-		return 2;
+	const struct src_dir *sd;
+	unsigned long hint = 0;
+
+	if (opts->buckets) {
+		return 1024UL * opts->buckets;
 	}
-	if (file_count < 100000) {
-		return 3;
+
+	list_for_each(&opts->src_dir_list, sd, list_entry) {
+		hint += find_estimate_files(sd->path);
 	}
-	if (file_count < 500000) {
-		return 4;
+
+	debug("table size hint: %lu\n", hint);
+
+	if (hint < table_hint_min) {
+		return table_hint_min;
 	}
-	if (file_count < 1000000) {
-		return 5;
+	if (hint > table_hint_max) {
+		return table_hint_max;
 	}
-	return 6;
+	return hint;
 }
 
 int main(int argc, char *argv[])
 {
 	struct src_dir *sd_safe;
 	struct src_dir *sd;
+	uint64_t pipeline_bytes = 0;
+	struct find_opts fo;
 	struct work_queue *wq;
 	struct hash_table *ht;
 	struct timer timer;
@@ -443,6 +630,9 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	digest_set_default_type(opts.digest);
+	digest_set_io(opts.hash_io);
+
 	if (0) {
 		thread_pool_test();
 		exit(EXIT_SUCCESS);
@@ -453,6 +643,11 @@ int main(int argc, char *argv[])
 		exit(EXIT_SUCCESS);
 	}
 
+	if (0) {
+		work_queue_bench();
+		exit(EXIT_SUCCESS);
+	}
+
 	if (0) {
 		timer_duration_test();
 		exit(EXIT_SUCCESS);
@@ -482,7 +677,7 @@ int main(int argc, char *argv[])
 	signal(SIGTERM, SIGTERM_handler);
 
 	if (1) {
-		ht = hash_table_init(1024UL * opts.buckets);
+		ht = hash_table_init(table_size_hint(&opts));
 		wq = work_queue_alloc(opts.jobs);
 	} else {
 		debug("jobs = 1, hash count = 10\n");
@@ -490,11 +685,23 @@ int main(int argc, char *argv[])
 		wq = work_queue_alloc(1);
 	}
 
+	fo = (struct find_opts) {
+		.no_sync = (opts.no_sync == opt_yes),
+		.times = (opts.digest_cache == opt_yes
+			|| opts.digest_xattr == opt_yes),
+		.no_atime = (opts.hash_io == digest_io_direct),
+		.pipeline_prefix = (opts.pipeline == opt_yes)
+			? opts.prefix_size * 1024 : 0,
+		.pipeline_bytes = &pipeline_bytes,
+		.file_arena = mem_arena_init("file records"),
+		.work_arena = mem_arena_init("find work items"),
+	};
+
 	fprintf(stderr, "find-dupes: Finding files...\n");
 
 	list_for_each(&opts.src_dir_list, sd, list_entry) {
 
-		result = find_files(wq, ht, check_for_signals, sd->path);
+		result = find_files(wq, ht, check_for_signals, &fo, sd->path);
 
 		if (result) {
 			debug("find_files failed: '%s', %d\n", sd->path, result);
@@ -509,17 +716,16 @@ int main(int argc, char *argv[])
 	}
 
 	i = 0;
-	while (!list_is_empty(&wq->ready_list)) {
+	while (!work_queue_wait(wq, wait_interval_ms)) {
 		i++;
 		if (check_for_signals()) {
 			debug("find wait %u (got signal)\n", i);
-			sleep(1);
-		} else {
-			debug("find wait %u\n", i);
-			sleep(1);
 		}
 	}
 
+	hash_table_settle(ht);
+	mem_arena_release(fo.work_arena);
+
 	if (check_for_signals()) {
 		debug("find signal cleanup\n");
 		work_queue_empty_ready_list(wq);
@@ -527,13 +733,17 @@ int main(int argc, char *argv[])
 		goto exit_clean;
 	}
 
+	if (opts.bucket_stats == opt_yes) {
+		hash_table_print_stats(ht, stderr);
+	}
+
 	if (1) {
 		FILE *empty_fp = list_file_open(opts.output_dir, "/empty.lst");
 
 		print_file_header_count(empty_fp, "Empty List",
-			list_item_count(&ht->extras));
+			empty_list_count(ht));
 
-		empty_list_print(&ht->extras, empty_fp, false);
+		empty_list_print(ht, empty_fp, false);
 
 		fclose(empty_fp);
 	}
@@ -543,7 +753,7 @@ int main(int argc, char *argv[])
 
 		print_file_header(files_fp, "Files List");
 
-		empty_list_print(&ht->extras, files_fp, true);
+		empty_list_print(ht, files_fp, true);
 		result = list_file_print(ht, files_fp);
 
 		if (result) {
@@ -554,14 +764,12 @@ int main(int argc, char *argv[])
 
 	if (1) {
 		struct compare_file_pointers fps;
+		struct compare_opts co;
 		unsigned int total_count;
 		unsigned int empty_count;
-		unsigned int sleep_time;
 
 		total_count = file_count(ht);
 
-		sleep_time = get_sleep_time(total_count);
-
 		fprintf(stderr, "find-dupes: Comparing %u files...\n",
 			total_count);
 
@@ -571,23 +779,43 @@ int main(int argc, char *argv[])
 		fps.unique = list_file_open(opts.output_dir, "/unique.lst");
 		print_file_header(fps.unique, "Unique List");
 
-		compare_files(wq, ht, check_for_signals, &fps);
+		fps.hard_links = list_file_open(opts.output_dir,
+			"/hard-links.lst");
+		print_file_header(fps.hard_links, "Hard Links List");
+
+		co = (struct compare_opts) {
+			.cache = NULL,
+			.xattr = (opts.digest_xattr == opt_yes),
+			.prefix_size = opts.prefix_size * 1024,
+		};
+
+		if (opts.digest_cache == opt_yes) {
+			co.cache = digest_cache_open(opts.digest_cache_file);
+		}
+
+		compare_files(wq, ht, check_for_signals, &co, &fps);
 
 		i = 0;
-		while (!list_is_empty(&wq->ready_list)) {
+		while (!work_queue_wait(wq, wait_interval_ms)) {
 			i++;
 			if (check_for_signals()) {
 				debug("compare wait %u (got signal)\n", i);
-				sleep(1);
-			} else {
-				
-				debug("compare wait %u\n", i);
-				sleep(sleep_time);
 			}
 		}
 
 		fclose(fps.dupes);
 		fclose(fps.unique);
+		fclose(fps.hard_links);
+
+		if (co.cache) {
+			if (!check_for_signals()) {
+				digest_cache_write(co.cache);
+				fprintf(stderr, "find-dupes: Digest cache: %lu hits, %lu misses, %lu pruned.\n",
+					co.cache->hits, co.cache->misses,
+					co.cache->pruned);
+			}
+			digest_cache_close(co.cache);
+		}
 
 		if (check_for_signals()) {
 			debug("compare signal cleanup\n");
@@ -596,10 +824,11 @@ int main(int argc, char *argv[])
 			goto exit_clean;
 		}
 
-		empty_count = list_item_count(&ht->extras);
-		empty_list_clean(&ht->extras);
+		empty_count = empty_list_count(ht);
+		empty_list_clean(ht);
 
-		compare_queue_print(wq, total_count, empty_count);
+		compare_queue_print(wq, total_count, empty_count,
+			pipeline_bytes);
 	}
 
 exit_clean:
@@ -607,6 +836,9 @@ exit_clean:
 
 	compare_queue_clean(wq);
 	work_queue_delete(wq);
+	hash_table_delete(ht);
+	mem_arena_delete(fo.work_arena);
+	mem_arena_delete(fo.file_arena);
 
 	log_flush();
 
@@ -12,52 +12,132 @@
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
 
+#include "dir-reader.h"
 #include "log.h"
 #include "mem.h"
 #include "util.h"
 
+#include "compare.h"
 #include "find.h"
 
-struct file_table_entry {
-	struct hash_table_entry hte;
-	struct file_data file_data;
+/*
+ * File records come from fo->file_arena and are returned all together when
+ * the caller releases it.
+ */
+
+void file_data_free(struct file_data *data)
+{
+	mem_arena_free(data);
+}
+
+struct file_stat {
+	unsigned long size;
+	unsigned long dev;
+	unsigned long ino;
+	uint64_t mtime_ns;
+	uint64_t ctime_ns;
+	unsigned int nlink;
+	unsigned int mode;
 };
 
-static struct file_table_entry *hte_to_fte(struct hash_table_entry *hte)
+/*
+ * Write the full path of a file into buf, which must hold file_path_max
+ * bytes.  The path is built backwards from the file name up to the root.
+ */
+
+char *file_data_path(const struct file_data *data, char *buf)
 {
-	return container_of(hte, struct file_table_entry, hte);
+	const struct dir_node *node;
+	size_t pos = file_data_path_len(data);
+
+	assert(pos < file_path_max);
+
+	buf[pos] = 0;
+	pos -= data->name_len;
+	memcpy(buf + pos, data->name, data->name_len);
+
+	for (node = data->dir; node; node = node->parent) {
+		buf[--pos] = '/';
+		pos -= node->name_len;
+		memcpy(buf + pos, node->name, node->name_len);
+	}
+
+	assert(pos == 0);
+	return buf;
 }
 
-void file_table_entry_clean(struct hash_table_entry *hte)
+static const struct dir_node *dir_node_init(struct mem_arena *arena,
+	const struct dir_node *parent, const char *name, unsigned int len)
 {
-	struct file_table_entry *fte = hte_to_fte(hte);
+	struct dir_node *node;
+
+	node = mem_arena_alloc(arena, sizeof(*node) + len + 1);
 
-	list_remove(&hte->list_entry);
+	node->parent = parent;
+	node->name_len = len;
+	node->path_len = parent ? parent->path_len + 1 + len : len;
+	memcpy(node->name, name, len + 1);
 
-	mem_free(fte);
+	return node;
 }
 
-static struct hash_table_entry *ht_entry_init(const char *file_name,
-	unsigned long file_size, struct list *list)
+static struct file_data *file_data_init(struct mem_arena *arena,
+	const struct dir_node *dir, const char *file_name,
+	const struct file_stat *fs)
 {
-	struct file_table_entry *fte;
+	struct file_data *data;
 	unsigned int len = strlen(file_name);
 
-	fte = mem_alloc_zero(sizeof(*fte) + len + 1);
+	data = mem_arena_alloc_zero(arena, sizeof(*data) + len + 1);
 
-	fte->file_data.name_len = len;
-	memcpy(fte->file_data.name, file_name, len);
+	data->dir = dir;
+	data->name_len = len;
+	memcpy(data->name, file_name, len);
 
-	digest_init(&fte->file_data.digest);
+	data->size = fs->size;
+	data->dev = fs->dev;
+	data->ino = fs->ino;
+	data->mtime_ns = fs->mtime_ns;
+	data->ctime_ns = fs->ctime_ns;
+	data->nlink = fs->nlink;
 
-	//debug("%p: '%s'\n", list, file_name);
-	hash_table_entry_init(&fte->hte, list, file_size, &fte->file_data);
+	digest_init(&data->digest);
 
-	return &fte->hte;
+	//debug("'%s'\n", data->name);
+	return data;
+}
+
+/*
+ * Opening with O_NOATIME keeps the scan from updating directory access times,
+ * but is only allowed for the owner.
+ *
+ * Directories are opened by full path rather than with openat() on the parent
+ * fd.  A sub directory is queued as a work item and may run long after its
+ * parent has been read, so the parent fd would have to stay open until every
+ * queued child had run, which on a wide tree is thousands of open fds.
+ */
+
+static int find_open_dir(const struct find_opts *fo, const char *path)
+{
+	int fd;
+
+	if (fo->no_atime) {
+		fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOATIME);
+
+		if (fd >= 0 || errno != EPERM) {
+			return fd;
+		}
+	}
+
+	return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 }
 
 static long int __attribute__((unused)) get_file_size_ftell(const char *file)
@@ -92,42 +172,164 @@ static long int __attribute__((unused)) get_file_size_ftell(const char *file)
 	return size;
 }
 
-static off_t get_file_size_stat64(const char *file)
+static void get_file_fstatat64(int dir_fd, const char *parent_path,
+	const char *file_name, struct file_stat *fs)
 {
 	struct stat64 st;
 	int result;
 
-	result = stat64(file, &st);
+	result = fstatat64(dir_fd, file_name, &st, AT_SYMLINK_NOFOLLOW);
 
 	if (result) {
-		log("ERROR: stat '%s' failed: %s\n", file, strerror(errno));
+		log("ERROR: fstatat '%s/%s' failed: %s\n", parent_path,
+			file_name, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
 	if (st.st_size < 0) {
-		log("ERROR: stat '%s' failed: %s\n", file, strerror(errno));
+		log("ERROR: fstatat '%s/%s' bad size: %ld\n", parent_path,
+			file_name, (long int)st.st_size);
 		exit(EXIT_FAILURE);
 	}
 
-	return st.st_size;
+	fs->size = st.st_size;
+	fs->dev = st.st_dev;
+	fs->ino = st.st_ino;
+	fs->mtime_ns = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+	fs->ctime_ns = st.st_ctim.tv_sec * 1000000000ULL + st.st_ctim.tv_nsec;
+	fs->nlink = st.st_nlink;
+	fs->mode = st.st_mode;
 }
 
-static void process_file(const char *file, struct hash_table *ht)
+#if defined(HAVE_STATX)
+static bool statx_unsupported;
+
+static int find_statx_flags(const struct find_opts *fo)
 {
-	struct hash_table_entry *hte;
-	off_t size;
+	return AT_SYMLINK_NOFOLLOW | (fo->no_sync ? AT_STATX_DONT_SYNC : 0);
+}
 
-	size = get_file_size_stat64(file);
+static unsigned int find_statx_mask(const struct find_opts *fo)
+{
+	return STATX_TYPE | STATX_SIZE | STATX_INO | STATX_NLINK
+		| (fo->times ? STATX_MTIME | STATX_CTIME : 0);
+}
 
-	if (size) {
-		unsigned int index = hash_table_index(ht, (long int)size);
+static uint64_t statx_timestamp_ns(const struct statx_timestamp *ts)
+{
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
 
-		hte = ht_entry_init(file, (long int)size, &ht->array[index]);
-		hash_table_insert(ht, index, hte);
-		//debug("index-%u: size = %ld, %s\n", index, (long int)size, file);
-	} else {
-		hte = ht_entry_init(file, (long int)size, &ht->extras);
-		hash_table_insert_extra(ht, hte);
+static bool file_stat_from_statx(const struct statx *stx,
+	const struct find_opts *fo, struct file_stat *fs)
+{
+	unsigned int mask = find_statx_mask(fo);
+
+	if ((stx->stx_mask & mask) != mask) {
+		return false;
+	}
+
+	fs->size = stx->stx_size;
+	fs->dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	fs->ino = stx->stx_ino;
+	fs->mtime_ns = statx_timestamp_ns(&stx->stx_mtime);
+	fs->ctime_ns = statx_timestamp_ns(&stx->stx_ctime);
+	fs->nlink = stx->stx_nlink;
+	fs->mode = stx->stx_mode;
+	return true;
+}
+
+/*
+ * Only ask for the attributes we use so network filesystems can skip the
+ * full attribute revalidation a stat64() forces.  Returns false when statx
+ * cannot be used and the caller should fall back to fstatat64().
+ */
+
+static bool get_file_statx(int dir_fd, const char *parent_path,
+	const char *file_name, const struct find_opts *fo,
+	struct file_stat *fs)
+{
+	struct statx stx;
+	int result;
+
+	if (__atomic_load_n(&statx_unsupported, __ATOMIC_RELAXED)) {
+		return false;
+	}
+
+	result = statx(dir_fd, file_name, find_statx_flags(fo),
+		find_statx_mask(fo), &stx);
+
+	if (result) {
+		if (errno == ENOSYS) {
+			debug("statx not supported, using fstatat.\n");
+			__atomic_store_n(&statx_unsupported, true,
+				__ATOMIC_RELAXED);
+			return false;
+		}
+		log("ERROR: statx '%s/%s' failed: %s\n", parent_path,
+			file_name, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	return file_stat_from_statx(&stx, fo, fs);
+}
+#endif
+
+static void get_file_stat(int dir_fd, const char *parent_path,
+	const char *file_name, const struct find_opts *fo,
+	struct file_stat *fs)
+{
+#if defined(HAVE_STATX)
+	if (get_file_statx(dir_fd, parent_path, file_name, fo, fs)) {
+		return;
+	}
+#else
+	(void)fo;
+#endif
+	get_file_fstatat64(dir_fd, parent_path, file_name, fs);
+}
+
+struct find_dir {
+	struct work_queue *wq;
+	struct hash_table *ht;
+	bool (*check_for_signals)(void);
+	const struct find_opts *fo;
+	const struct dir_node *node;
+	const char *path;
+	unsigned int path_len;
+	int fd;
+};
+
+/*
+ * In pipeline mode the second file found of a size has both its own prefix
+ * and that of the first file of the size queued for hashing, and every later
+ * file of the size its own.  Hard links to the first file are skipped.
+ */
+
+static void find_pipeline(const struct find_dir *dir,
+	struct file_data *first, struct file_data *data)
+{
+	if (first->dev == data->dev && first->ino == data->ino) {
+		return;
+	}
+
+	compare_queue_prefix(dir->wq, dir->check_for_signals, dir->fo, first);
+	compare_queue_prefix(dir->wq, dir->check_for_signals, dir->fo, data);
+}
+
+static void process_file(const struct find_dir *dir, const char *file_name,
+	const struct file_stat *fs)
+{
+	struct file_data *first;
+	struct file_data *data;
+
+	data = file_data_init(dir->fo->file_arena, dir->node, file_name, fs);
+
+	first = hash_table_insert(dir->ht, fs->size, data);
+	//debug("size = %lu, %s\n", fs->size, file_name);
+
+	if (first && fs->size && dir->fo->pipeline_prefix) {
+		find_pipeline(dir, first, data);
 	}
 }
 
@@ -135,9 +337,15 @@ struct find_files_cb_data {
 	struct work_queue *wq;
 	struct hash_table *ht;
 	bool (*check_for_signals)(void);
+	const struct find_opts *fo;
+	const struct dir_node *node;
 	char *sub_path;
 };
 
+static int find_dir_files(struct work_queue *wq, struct hash_table *ht,
+	bool (*check_for_signals)(void), const struct find_opts *fo,
+	const struct dir_node *node, const char *parent_path);
+
 static int find_files_cb(struct work_item *wi)
 {
 	struct find_files_cb_data *cbd = wi->cb_data;
@@ -147,138 +355,197 @@ static int find_files_cb(struct work_item *wi)
 	//dup = strdup(cbd->sub_path);
 	//debug("> '%s'\n", cbd->sub_path);
 
-	result = find_files(cbd->wq, cbd->ht, cbd->check_for_signals,
-		cbd->sub_path);
-
-	assert(wi->list_entry.in_use);
+	result = find_dir_files(cbd->wq, cbd->ht, cbd->check_for_signals,
+		cbd->fo, cbd->node, cbd->sub_path);
 
-	list_remove(&wi->list_entry);
-
-	mem_free(wi);
+	mem_arena_free(wi);
 
 	//debug("< '%s'\n", dup);
 	//free(dup);
 	return result;
 }
 
-static void find_files_queue_work(unsigned int id, struct work_queue *wq,
-	struct hash_table *ht, bool (*check_for_signals)(void),
-	const char *sub_path)
+static void find_files_queue_work(unsigned int id,
+	const struct find_dir *dir, const char *sub_name)
 {
 	struct find_files_cb_data *cbd;
 	struct work_item *wi;
-	unsigned int sub_path_len = strlen(sub_path) + 1;
+	unsigned int sub_len = strlen(sub_name);
 
-	wi = mem_alloc_zero(sizeof(*wi) + sizeof(*cbd) + sub_path_len);
+	wi = mem_arena_alloc_zero(dir->fo->work_arena, sizeof(*wi)
+		+ sizeof(*cbd) + dir->path_len + sub_len + 2);
 
 	cbd = (void*)(wi + 1);
 	cbd->sub_path = (void*)(cbd + 1);
-	cbd->wq = wq;
-	cbd->ht = ht;
-	cbd->check_for_signals = check_for_signals;
-	memcpy(cbd->sub_path, sub_path, sub_path_len);
+	cbd->wq = dir->wq;
+	cbd->ht = dir->ht;
+	cbd->check_for_signals = dir->check_for_signals;
+	cbd->fo = dir->fo;
+	cbd->node = dir_node_init(dir->fo->file_arena, dir->node, sub_name,
+		sub_len);
+	memcpy(cbd->sub_path, dir->path, dir->path_len);
+	cbd->sub_path[dir->path_len] = '/';
+	memcpy(cbd->sub_path + dir->path_len + 1, sub_name, sub_len + 1);
 
 	wi->id = id;
 	wi->cb = find_files_cb;
 	wi->cb_data = cbd;
 
-	work_queue_add_item(wq, wi);
+	work_queue_add_item(dir->wq, wi);
 }
 
-int find_files(struct work_queue *wq, struct hash_table *ht,
-	bool (*check_for_signals)(void), const char *parent_path)
+/*
+ * Entries that are not known to be directories are stat'ed first, then
+ * recorded as files or queued as sub directories.
+ */
+
+static void find_dir_entry(const struct find_dir *dir, unsigned int id,
+	const char *name)
+{
+	struct file_stat fs;
+
+	get_file_stat(dir->fd, dir->path, name, dir->fo, &fs);
+
+	if (S_ISREG(fs.mode)) {
+		process_file(dir, name, &fs);
+	} else if (S_ISDIR(fs.mode)) {
+		find_files_queue_work(id, dir, name);
+	}
+}
+
+/*
+ * The directory is opened once and its entries are looked up relative to
+ * the directory fd, so the kernel does not walk the full path for every
+ * file.  Full paths are only built for the sub directory work items, file
+ * records only keep their name and directory node.
+ *
+ * Entries are read in batches with the dir_reader.  The entry names point
+ * into the reader buffer, so each entry is handled before the next fill.
+ */
+
+static int find_dir_files(struct work_queue *wq, struct hash_table *ht,
+	bool (*check_for_signals)(void), const struct find_opts *fo,
+	const struct dir_node *node, const char *parent_path)
 {
-	unsigned int parent_len = 0;
-	struct dirent *de;
-	unsigned int id;
+	struct find_dir dir = {
+		.wq = wq,
+		.ht = ht,
+		.check_for_signals = check_for_signals,
+		.fo = fo,
+		.node = node,
+		.path = parent_path,
+		.path_len = strlen(parent_path),
+	};
+	struct dir_reader dr;
+	unsigned int id = 0;
 	int result = 0;
-	DIR *dp;
 
 	//debug("> '%s'\n", parent_path);
 
-	dp = opendir(parent_path);
+	dir.fd = find_open_dir(fo, parent_path);
 
-	if (!dp) {
-		log("ERROR: opendir '%s' failed: %s\n", parent_path,
+	if (dir.fd < 0) {
+		log("ERROR: open '%s' failed: %s\n", parent_path,
 			strerror(errno));
 		exit(EXIT_FAILURE);
-
 	}
 
-	for (id = 0; ; id++) {
+	dir_reader_init(&dr, dir.fd);
+
+	while (dir_reader_fill(&dr, parent_path)) {
+		struct dir_reader_entry de;
+
 		if (check_for_signals()) {
 			//debug("exit on signal\n");
 			result = -1;
 			goto exit;
 		}
 
-		de = readdir(dp);
-
-		if (!de) {
-			//debug("done:  '%s'\n", parent_path);
-			break;
+		while (dir_reader_next(&dr, &de)) {
+			//debug("d_name = '%s'\n", de.name);
+
+			switch (de.type) {
+			case DT_DIR:
+				if (test_for_dots(de.name)) {
+					continue;
+				}
+				//debug("DT_DIR: %s/%s\n", parent_path, de.name);
+				find_files_queue_work(id++, &dir, de.name);
+				break;
+			case DT_REG:
+			case DT_UNKNOWN:
+				if (test_for_dots(de.name)) {
+					continue;
+				}
+				//debug("DT_REG: %s/%s\n", parent_path, de.name);
+				find_dir_entry(&dir, id++, de.name);
+				break;
+			default:
+				break;
+			}
 		}
+	}
 
-		//debug("d_name = '%s'\n", de->d_name);
-
-		switch (de->d_type) {
-		case DT_DIR: {
-			char *sub_path;
+	//debug("done:  '%s'\n", parent_path);
 
-			if (test_for_dots(de->d_name)) {
-				continue;
-			}
-			//debug("DIR:  '%s'\n", de->d_name);
+exit:
+	close(dir.fd);
+	//debug("< '%s'\n", parent_path);
+	return result;
+}
 
-			if (!parent_len) {
-				parent_len = strlen(parent_path);
-			}
+/*
+ * The source directory becomes the root node of its tree, each sub directory
+ * gets a node when its work item is queued.
+ */
 
-			sub_path = make_sub_path(parent_path, parent_len,
-				de->d_name);
+int find_files(struct work_queue *wq, struct hash_table *ht,
+	bool (*check_for_signals)(void), const struct find_opts *fo,
+	const char *parent_path)
+{
+	const struct dir_node *root;
 
-			//debug("DT_DIR: %s\n", sub_path);
-			find_files_queue_work(id, wq, ht, check_for_signals,
-				sub_path);
-			mem_free(sub_path);
+	root = dir_node_init(fo->file_arena, NULL, parent_path,
+		strlen(parent_path));
 
-			break;
-		}
-		case DT_REG: {
-			char *sub_path;
+	return find_dir_files(wq, ht, check_for_signals, fo, root,
+		parent_path);
+}
 
-			if (!parent_len) {
-				parent_len = strlen(parent_path);
-			}
-			sub_path = make_sub_path(parent_path, parent_len,
-				de->d_name);
+static bool file_count_cb(void *cb_data, const struct hash_table_slot *slot)
+{
+	unsigned long *count = cb_data;
 
-			//debug("DT_REG: %s\n", sub_path);
-			process_file(sub_path, ht);
-			mem_free(sub_path);
+	*count += slot->count;
+	return false;
+}
 
-			break;
-		}
-		default:
-			break;
-		}
-	}
+unsigned long file_count(const struct hash_table *ht)
+{
+	unsigned long count = 0;
 
-exit:
-	closedir(dp);
-	//debug("< '%s'\n", parent_path);
-	return result;
+	hash_table_for_each_slot(ht, file_count_cb, &count);
+	return count;
 }
 
-unsigned long file_count(struct hash_table *ht)
+/*
+ * The number of inodes in use on the filesystem holding path, as an upper
+ * bound on the files a scan of path can find.  Returns 0 when the
+ * filesystem does not report inode counts.
+ */
+
+unsigned long find_estimate_files(const char *path)
 {
-	unsigned long count;
-	unsigned int i;
+	struct statvfs sv;
 
-	count = list_item_count(&ht->extras);
+	if (statvfs(path, &sv)) {
+		debug("statvfs '%s' failed: %s\n", path, strerror(errno));
+		return 0;
+	}
 
-	for (i = 0; i < ht->count; i++) {
-		count += list_item_count(&(ht->array[i]));
+	if (!sv.f_files || sv.f_ffree > sv.f_files) {
+		return 0;
 	}
-	return count;
+
+	return sv.f_files - sv.f_ffree;
 }
@@ -5,20 +5,69 @@
 #if !defined(_FIND_FILES_H)
 #define _FIND_FILES_H
 
+#include <limits.h>
+
 #include "digest.h"
 #include "hash-table.h"
+#include "mem.h"
 #include "work-queue.h"
 
+/*
+ * A directory of the scanned trees.  Files point to their directory node
+ * and only store their own name, full paths are rebuilt when needed.  The
+ * source directories are the roots, with the path as given as their name.
+ */
+
+struct dir_node {
+	const struct dir_node *parent;
+	unsigned int path_len;
+	unsigned int name_len;
+	char name[];
+};
+
+enum {file_path_max = PATH_MAX + NAME_MAX + 2};
+
 struct file_data {
 	struct digest digest;
+	uint64_t prefix_hash;
+	uint64_t suffix_hash;
+	uint64_t size;
+	unsigned long dev;
+	unsigned long ino;
+	uint64_t mtime_ns;
+	uint64_t ctime_ns;
+	unsigned int nlink;
 	bool matched;
-	size_t name_len;
+	bool prefix_queued;
+	bool prefix_done;
+	bool suffix_done;
+	bool cache_checked;
+	const struct dir_node *dir;
+	unsigned int name_len;
 	char name[];
 };
 
+static inline size_t file_data_path_len(const struct file_data *data)
+{
+	return data->dir->path_len + 1 + data->name_len;
+}
+
+struct find_opts {
+	bool no_sync;
+	bool times;
+	bool no_atime;
+	unsigned int pipeline_prefix;
+	uint64_t *pipeline_bytes;
+	struct mem_arena *file_arena;
+	struct mem_arena *work_arena;
+};
+
 int find_files(struct work_queue *wq, struct hash_table *ht,
-	bool (*check_for_signals)(void), const char *parent_path);
-void file_table_entry_clean(struct hash_table_entry *hte);
-unsigned long file_count(struct hash_table *ht);
+	bool (*check_for_signals)(void), const struct find_opts *fo,
+	const char *parent_path);
+void file_data_free(struct file_data *data);
+char *file_data_path(const struct file_data *data, char *buf);
+unsigned long file_count(const struct hash_table *ht);
+unsigned long find_estimate_files(const char *path);
 
 #endif /* _FIND_FILES_H */
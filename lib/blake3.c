@@ -0,0 +1,385 @@
+/*
+ *  BLAKE3 hash.
+ *
+ *  A straightforward implementation of the BLAKE3 hash mode without keyed
+ *  hashing or extended output.  Full chunks are hashed blake3_lanes at a
+ *  time with GCC vector extensions, one chunk per vector lane.  On x86-64
+ *  the chunk function is built for AVX-512, AVX2 and the baseline ISA and
+ *  the best version for the CPU is picked at load time.  Other targets use
+ *  their native vector unit, like NEON on aarch64.
+ */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "blake3.h"
+
+enum {
+	blake3_chunk_start = 1 << 0,
+	blake3_chunk_end = 1 << 1,
+	blake3_parent = 1 << 2,
+	blake3_root = 1 << 3,
+};
+
+enum {blake3_lanes = 16};
+
+#if defined(HAVE_TARGET_CLONES) && defined(__x86_64__)
+# define blake3_target_clones \
+	__attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+# define blake3_target_clones
+#endif
+
+typedef uint32_t blake3_vec __attribute__((vector_size(blake3_lanes * 4)));
+
+static const uint32_t blake3_iv[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+static const uint8_t blake3_schedule[7][16] = {
+	{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+	{2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+	{3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+	{10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+	{12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+	{9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+	{11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+struct blake3_output {
+	uint32_t cv[8];
+	uint8_t block[blake3_block_len];
+	uint8_t block_len;
+	uint8_t flags;
+	uint64_t counter;
+};
+
+static inline uint32_t blake3_load32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16)
+		| ((uint32_t)p[3] << 24);
+}
+
+static inline void blake3_store32(uint8_t *p, uint32_t x)
+{
+	p[0] = x;
+	p[1] = x >> 8;
+	p[2] = x >> 16;
+	p[3] = x >> 24;
+}
+
+#define blake3_rotr(_x, _n) (((_x) >> (_n)) | ((_x) << (32 - (_n))))
+
+#define blake3_g(_v, _a, _b, _c, _d, _x, _y) do { \
+	_v[_a] = _v[_a] + _v[_b] + (_x); \
+	_v[_d] = blake3_rotr(_v[_d] ^ _v[_a], 16); \
+	_v[_c] = _v[_c] + _v[_d]; \
+	_v[_b] = blake3_rotr(_v[_b] ^ _v[_c], 12); \
+	_v[_a] = _v[_a] + _v[_b] + (_y); \
+	_v[_d] = blake3_rotr(_v[_d] ^ _v[_a], 8); \
+	_v[_c] = _v[_c] + _v[_d]; \
+	_v[_b] = blake3_rotr(_v[_b] ^ _v[_c], 7); \
+} while (0)
+
+#define blake3_round(_v, _m, _r) do { \
+	const uint8_t *_s = blake3_schedule[_r]; \
+	blake3_g(_v, 0, 4, 8, 12, _m[_s[0]], _m[_s[1]]); \
+	blake3_g(_v, 1, 5, 9, 13, _m[_s[2]], _m[_s[3]]); \
+	blake3_g(_v, 2, 6, 10, 14, _m[_s[4]], _m[_s[5]]); \
+	blake3_g(_v, 3, 7, 11, 15, _m[_s[6]], _m[_s[7]]); \
+	blake3_g(_v, 0, 5, 10, 15, _m[_s[8]], _m[_s[9]]); \
+	blake3_g(_v, 1, 6, 11, 12, _m[_s[10]], _m[_s[11]]); \
+	blake3_g(_v, 2, 7, 8, 13, _m[_s[12]], _m[_s[13]]); \
+	blake3_g(_v, 3, 4, 9, 14, _m[_s[14]], _m[_s[15]]); \
+} while (0)
+
+static void blake3_compress(const uint32_t cv[8],
+	const uint8_t block[blake3_block_len], uint8_t block_len,
+	uint64_t counter, uint8_t flags, uint32_t out[16])
+{
+	uint32_t m[16];
+	uint32_t v[16];
+	unsigned int i;
+
+	for (i = 0; i < 16; i++) {
+		m[i] = blake3_load32(block + 4 * i);
+	}
+
+	for (i = 0; i < 8; i++) {
+		v[i] = cv[i];
+	}
+	v[8] = blake3_iv[0];
+	v[9] = blake3_iv[1];
+	v[10] = blake3_iv[2];
+	v[11] = blake3_iv[3];
+	v[12] = (uint32_t)counter;
+	v[13] = (uint32_t)(counter >> 32);
+	v[14] = block_len;
+	v[15] = flags;
+
+	for (i = 0; i < 7; i++) {
+		blake3_round(v, m, i);
+	}
+
+	for (i = 0; i < 8; i++) {
+		out[i] = v[i] ^ v[i + 8];
+		out[i + 8] = v[i + 8] ^ cv[i];
+	}
+}
+
+static void blake3_output_cv(const struct blake3_output *output,
+	uint32_t cv[8])
+{
+	uint32_t out[16];
+
+	blake3_compress(output->cv, output->block, output->block_len,
+		output->counter, output->flags, out);
+	memcpy(cv, out, 8 * sizeof(cv[0]));
+}
+
+static void blake3_chunk_output(const uint8_t *input, size_t len,
+	uint64_t counter, struct blake3_output *output)
+{
+	uint8_t flags = blake3_chunk_start;
+	uint32_t cv[8];
+
+	memcpy(cv, blake3_iv, sizeof(cv));
+
+	while (len > blake3_block_len) {
+		uint32_t out[16];
+
+		blake3_compress(cv, input, blake3_block_len, counter, flags,
+			out);
+		memcpy(cv, out, sizeof(cv));
+		flags = 0;
+		input += blake3_block_len;
+		len -= blake3_block_len;
+	}
+
+	memcpy(output->cv, cv, sizeof(cv));
+	memset(output->block, 0, sizeof(output->block));
+	memcpy(output->block, input, len);
+	output->block_len = len;
+	output->flags = flags | blake3_chunk_end;
+	output->counter = counter;
+}
+
+static void blake3_parent_output(const uint32_t left[8],
+	const uint32_t right[8], struct blake3_output *output)
+{
+	unsigned int i;
+
+	memcpy(output->cv, blake3_iv, sizeof(output->cv));
+
+	for (i = 0; i < 8; i++) {
+		blake3_store32(output->block + 4 * i, left[i]);
+		blake3_store32(output->block + 32 + 4 * i, right[i]);
+	}
+
+	output->block_len = blake3_block_len;
+	output->flags = blake3_parent;
+	output->counter = 0;
+}
+
+/*
+ * Hash count full chunks, each in its own vector lane.
+ */
+
+blake3_target_clones
+static void blake3_hash_chunks(const uint8_t *input, unsigned int count,
+	uint64_t counter, uint32_t cvs[blake3_lanes][8])
+{
+	uint32_t words[16][blake3_lanes];
+	blake3_vec cv[8];
+	blake3_vec m[16];
+	blake3_vec v[16];
+	blake3_vec counter_lo;
+	blake3_vec counter_hi;
+	unsigned int block;
+	unsigned int lane;
+	unsigned int i;
+
+	for (lane = 0; lane < blake3_lanes; lane++) {
+		uint64_t c = counter + (lane < count ? lane : 0);
+
+		counter_lo[lane] = (uint32_t)c;
+		counter_hi[lane] = (uint32_t)(c >> 32);
+	}
+
+	for (i = 0; i < 8; i++) {
+		cv[i] = (blake3_vec){0} + blake3_iv[i];
+	}
+
+	memset(words, 0, sizeof(words));
+
+	for (block = 0; block < blake3_chunk_len / blake3_block_len; block++) {
+		uint32_t flags = 0;
+
+		for (lane = 0; lane < count; lane++) {
+			const uint8_t *p = input + lane * blake3_chunk_len
+				+ block * blake3_block_len;
+
+			for (i = 0; i < 16; i++) {
+				words[i][lane] = blake3_load32(p + 4 * i);
+			}
+		}
+
+		for (i = 0; i < 16; i++) {
+			memcpy(&m[i], words[i], sizeof(m[i]));
+		}
+
+		if (block == 0) {
+			flags |= blake3_chunk_start;
+		}
+		if (block == blake3_chunk_len / blake3_block_len - 1) {
+			flags |= blake3_chunk_end;
+		}
+
+		for (i = 0; i < 8; i++) {
+			v[i] = cv[i];
+		}
+		v[8] = (blake3_vec){0} + blake3_iv[0];
+		v[9] = (blake3_vec){0} + blake3_iv[1];
+		v[10] = (blake3_vec){0} + blake3_iv[2];
+		v[11] = (blake3_vec){0} + blake3_iv[3];
+		v[12] = counter_lo;
+		v[13] = counter_hi;
+		v[14] = (blake3_vec){0} + (uint32_t)blake3_block_len;
+		v[15] = (blake3_vec){0} + flags;
+
+		blake3_round(v, m, 0);
+		blake3_round(v, m, 1);
+		blake3_round(v, m, 2);
+		blake3_round(v, m, 3);
+		blake3_round(v, m, 4);
+		blake3_round(v, m, 5);
+		blake3_round(v, m, 6);
+
+		for (i = 0; i < 8; i++) {
+			cv[i] = v[i] ^ v[i + 8];
+		}
+	}
+
+	for (lane = 0; lane < count; lane++) {
+		for (i = 0; i < 8; i++) {
+			cvs[lane][i] = cv[i][lane];
+		}
+	}
+}
+
+static void blake3_push_cv(struct blake3_hasher *hasher, uint32_t cv[8],
+	uint64_t total_chunks)
+{
+	while (!(total_chunks & 1)) {
+		struct blake3_output output;
+
+		hasher->cv_stack_len--;
+		blake3_parent_output(hasher->cv_stack[hasher->cv_stack_len],
+			cv, &output);
+		blake3_output_cv(&output, cv);
+		total_chunks >>= 1;
+	}
+
+	memcpy(hasher->cv_stack[hasher->cv_stack_len], cv, 8 * sizeof(cv[0]));
+	hasher->cv_stack_len++;
+}
+
+void blake3_init(struct blake3_hasher *hasher)
+{
+	hasher->cv_stack_len = 0;
+	hasher->chunk_counter = 0;
+	hasher->buf_len = 0;
+}
+
+/*
+ * A chunk is only hashed once more input follows it, since the last chunk
+ * needs to be finalized differently.
+ */
+
+void blake3_update(struct blake3_hasher *hasher, const void *data, size_t len)
+{
+	const uint8_t *input = data;
+
+	if (hasher->buf_len) {
+		size_t take = blake3_chunk_len - hasher->buf_len;
+		struct blake3_output output;
+		uint32_t cv[8];
+
+		if (take > len) {
+			take = len;
+		}
+
+		memcpy(hasher->buf + hasher->buf_len, input, take);
+		hasher->buf_len += take;
+		input += take;
+		len -= take;
+
+		if (!len) {
+			return;
+		}
+
+		blake3_chunk_output(hasher->buf, blake3_chunk_len,
+			hasher->chunk_counter, &output);
+		blake3_output_cv(&output, cv);
+		hasher->chunk_counter++;
+		blake3_push_cv(hasher, cv, hasher->chunk_counter);
+		hasher->buf_len = 0;
+	}
+
+	while (len > blake3_chunk_len) {
+		uint32_t cvs[blake3_lanes][8];
+		size_t count = (len - 1) / blake3_chunk_len;
+		unsigned int i;
+
+		if (count > blake3_lanes) {
+			count = blake3_lanes;
+		}
+
+		blake3_hash_chunks(input, count, hasher->chunk_counter, cvs);
+
+		for (i = 0; i < count; i++) {
+			hasher->chunk_counter++;
+			blake3_push_cv(hasher, cvs[i], hasher->chunk_counter);
+		}
+
+		input += count * blake3_chunk_len;
+		len -= count * blake3_chunk_len;
+	}
+
+	memcpy(hasher->buf, input, len);
+	hasher->buf_len = len;
+}
+
+void blake3_final(const struct blake3_hasher *hasher, void *out,
+	size_t out_len)
+{
+	struct blake3_output output;
+	unsigned int depth = hasher->cv_stack_len;
+	uint8_t bytes[blake3_out_len];
+	uint32_t words[16];
+	unsigned int i;
+
+	blake3_chunk_output(hasher->buf, hasher->buf_len,
+		hasher->chunk_counter, &output);
+
+	while (depth) {
+		uint32_t cv[8];
+
+		depth--;
+		blake3_output_cv(&output, cv);
+		blake3_parent_output(hasher->cv_stack[depth], cv, &output);
+	}
+
+	blake3_compress(output.cv, output.block, output.block_len, 0,
+		output.flags | blake3_root, words);
+
+	for (i = 0; i < 8; i++) {
+		blake3_store32(bytes + 4 * i, words[i]);
+	}
+
+	memcpy(out, bytes, out_len < sizeof(bytes) ? out_len : sizeof(bytes));
+}
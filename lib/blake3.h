@@ -0,0 +1,31 @@
+/*
+ *  BLAKE3 hash.
+ */
+
+#if !defined(_LIB_BLAKE3_H)
+#define _LIB_BLAKE3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+	blake3_block_len = 64,
+	blake3_chunk_len = 1024,
+	blake3_out_len = 32,
+	blake3_max_depth = 54,
+};
+
+struct blake3_hasher {
+	uint32_t cv_stack[blake3_max_depth + 1][8];
+	unsigned int cv_stack_len;
+	uint64_t chunk_counter;
+	size_t buf_len;
+	uint8_t buf[blake3_chunk_len];
+};
+
+void blake3_init(struct blake3_hasher *hasher);
+void blake3_update(struct blake3_hasher *hasher, const void *data, size_t len);
+void blake3_final(const struct blake3_hasher *hasher, void *out,
+	size_t out_len);
+
+#endif /* _LIB_BLAKE3_H */
@@ -0,0 +1,519 @@
+/*
+ *  Persistent digest cache.
+ *
+ *  The cache file is a header, an array of fixed size entries sorted by
+ *  (dev, ino) so it can be mapped and searched in place, and the paths of
+ *  the entries.  An entry is only used when the size, mtime, ctime and
+ *  digest type all still match.  digest_cache_write() replaces the file with
+ *  the entries used or added by this run, and keeps the unused entries whose
+ *  path still names the same unchanged file.
+ */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "digest-cache.h"
+#include "list.h"
+#include "log.h"
+#include "mem.h"
+
+static const char digest_cache_magic[8] = "fdcache";
+static const uint32_t digest_cache_version = 3;
+
+struct digest_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+	uint64_t count;
+	uint64_t names_size;
+};
+
+/*
+ * What this run learned about each entry of the mapped cache.  A stale entry
+ * was looked up and found not to match its file.
+ */
+
+enum digest_cache_state {
+	digest_cache_unknown = 0,
+	digest_cache_used,
+	digest_cache_stale,
+};
+
+static int digest_cache_key_compare(const struct digest_cache_key *a,
+	const struct digest_cache_key *b)
+{
+	if (a->dev != b->dev) {
+		return a->dev < b->dev ? -1 : 1;
+	}
+	if (a->ino != b->ino) {
+		return a->ino < b->ino ? -1 : 1;
+	}
+	return 0;
+}
+
+static int digest_cache_entry_compare(const void *a, const void *b)
+{
+	return digest_cache_key_compare(
+		&((const struct digest_cache_entry *)a)->key,
+		&((const struct digest_cache_entry *)b)->key);
+}
+
+static bool digest_cache_map(struct digest_cache *dc)
+{
+	const struct digest_cache_header *header;
+	struct stat st;
+	uint64_t entries_size;
+
+	if (stat(dc->path, &st) || (size_t)st.st_size < sizeof(*header)) {
+		debug("no cache: '%s'\n", dc->path);
+		return false;
+	}
+
+	mapped_file_map(&dc->mfi, dc->path);
+	header = dc->mfi.addr;
+	entries_size = header->count * sizeof(struct digest_cache_entry);
+
+	if (memcmp(header->magic, digest_cache_magic, sizeof(header->magic))
+		|| header->version != digest_cache_version
+		|| header->entry_size != sizeof(struct digest_cache_entry)
+		|| header->count > dc->mfi.size / sizeof(struct digest_cache_entry)
+		|| sizeof(*header) + entries_size + header->names_size
+			!= dc->mfi.size
+		|| (header->names_size && ((const char *)dc->mfi.addr)
+			[dc->mfi.size - 1])) {
+		log("WARNING: Ignoring bad digest cache '%s'.\n", dc->path);
+		mapped_file_unmap(&dc->mfi);
+		return false;
+	}
+
+	dc->entries = (const void *)(header + 1);
+	dc->count = header->count;
+	dc->names = (const char *)dc->entries + entries_size;
+	dc->names_size = header->names_size;
+
+	debug("'%s': %lu entries\n", dc->path, (unsigned long)dc->count);
+	return true;
+}
+
+struct digest_cache *digest_cache_open(const char *path)
+{
+	struct digest_cache *dc;
+	int result;
+
+	dc = mem_alloc_zero(sizeof(*dc));
+	dc->path = mem_strdup(path);
+	dc->cwd = getcwd(NULL, 0);
+
+	result = mtx_init(&dc->mtx, mtx_plain);
+
+	if (result) {
+		on_error("mtx_init.\n");
+	}
+
+	if (!digest_cache_map(dc)) {
+		dc->entries = NULL;
+		dc->count = 0;
+	}
+
+	if (dc->count) {
+		dc->states = mem_alloc_zero(dc->count);
+	}
+
+	return dc;
+}
+
+static void digest_cache_names_append(struct digest_cache_names *names,
+	const char *str, size_t len)
+{
+	if (names->len + len > names->size) {
+		names->size = names->size ? 2 * names->size : 64 * 1024;
+
+		if (names->size < names->len + len) {
+			names->size = names->len + len;
+		}
+
+		names->data = realloc(names->data, names->size);
+
+		if (!names->data) {
+			on_error("realloc failed.\n");
+		}
+	}
+
+	memcpy(names->data + names->len, str, len);
+	names->len += len;
+}
+
+/*
+ * Add a path to names, made absolute with dir when it is relative.  Returns
+ * its offset.
+ */
+
+static uint64_t digest_cache_names_add(struct digest_cache_names *names,
+	const char *dir, const char *path)
+{
+	uint64_t offset = names->len;
+
+	if (dir && path[0] != '/') {
+		digest_cache_names_append(names, dir, strlen(dir));
+		digest_cache_names_append(names, "/", 1);
+	}
+
+	digest_cache_names_append(names, path, strlen(path) + 1);
+	return offset;
+}
+
+bool digest_cache_lookup(struct digest_cache *dc,
+	const struct digest_cache_key *key, struct digest *digest)
+{
+	const struct digest_cache_entry *entry = NULL;
+	uint64_t first = 0;
+	uint64_t last = dc->count;
+	uint64_t mid = 0;
+
+	while (first < last) {
+		int result;
+
+		mid = first + (last - first) / 2;
+		result = digest_cache_key_compare(key, &dc->entries[mid].key);
+
+		if (!result) {
+			entry = &dc->entries[mid];
+			break;
+		}
+		if (result < 0) {
+			last = mid;
+		} else {
+			first = mid + 1;
+		}
+	}
+
+	if (!entry || entry->key.size != key->size
+		|| entry->key.mtime_ns != key->mtime_ns
+		|| entry->key.ctime_ns != key->ctime_ns
+		|| entry->digest.type != digest->type) {
+		if (entry) {
+			__atomic_store_n(&dc->states[mid], digest_cache_stale,
+				__ATOMIC_RELAXED);
+		}
+		__atomic_add_fetch(&dc->misses, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	*digest = entry->digest;
+	__atomic_store_n(&dc->states[mid], digest_cache_used,
+		__ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&dc->hits, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+void digest_cache_insert(struct digest_cache *dc,
+	const struct digest_cache_key *key, const char *path,
+	const struct digest *digest)
+{
+	struct digest_cache_entry entry;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.key = *key;
+	entry.digest = *digest;
+
+	list_lock(&dc->mtx);
+
+	if (dc->new_count == dc->new_size) {
+		dc->new_size = dc->new_size ? 2 * dc->new_size : 1024;
+		dc->new_entries = realloc(dc->new_entries,
+			dc->new_size * sizeof(dc->new_entries[0]));
+
+		if (!dc->new_entries) {
+			on_error("realloc failed.\n");
+		}
+	}
+
+	entry.name = digest_cache_names_add(&dc->new_names, dc->cwd, path);
+	dc->new_entries[dc->new_count++] = entry;
+
+	list_unlock(&dc->mtx);
+}
+
+/*
+ * An entry this run did not look up is kept while its path still names the
+ * same inode with the same size and times.  Anything else means the file is
+ * gone or has changed.
+ */
+
+static bool digest_cache_entry_keep(const struct digest_cache *dc,
+	uint64_t index)
+{
+	const struct digest_cache_entry *entry = &dc->entries[index];
+	struct stat st;
+
+	switch (dc->states[index]) {
+	case digest_cache_used:
+		return true;
+	case digest_cache_stale:
+		return false;
+	default:
+		break;
+	}
+
+	if (entry->name >= dc->names_size || fstatat(AT_FDCWD,
+		dc->names + entry->name, &st, AT_SYMLINK_NOFOLLOW)) {
+		return false;
+	}
+
+	return (uint64_t)st.st_dev == entry->key.dev
+		&& (uint64_t)st.st_ino == entry->key.ino
+		&& (uint64_t)st.st_size == entry->key.size
+		&& st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec
+			== entry->key.mtime_ns
+		&& st.st_ctim.tv_sec * 1000000000ULL + st.st_ctim.tv_nsec
+			== entry->key.ctime_ns;
+}
+
+/*
+ * Merge the sorted mapped entries with the sorted new entries.  A new entry
+ * replaces a mapped entry for the same inode.
+ */
+
+static uint64_t digest_cache_merge(struct digest_cache *dc,
+	struct digest_cache_entry *out, struct digest_cache_names *names)
+{
+	uint64_t count = 0;
+	uint64_t i = 0;
+	uint64_t j = 0;
+
+	while (i < dc->count || j < dc->new_count) {
+		const struct digest_cache_entry *entry;
+		const char *name;
+		int result;
+
+		if (i == dc->count) {
+			result = 1;
+		} else if (j == dc->new_count) {
+			result = -1;
+		} else {
+			result = digest_cache_entry_compare(&dc->entries[i],
+				&dc->new_entries[j]);
+		}
+
+		if (result < 0) {
+			if (!digest_cache_entry_keep(dc, i)) {
+				dc->pruned++;
+				i++;
+				continue;
+			}
+			entry = &dc->entries[i++];
+			name = dc->names + entry->name;
+		} else {
+			if (!result) {
+				i++;
+			}
+			entry = &dc->new_entries[j++];
+			name = dc->new_names.data + entry->name;
+		}
+
+		out[count] = *entry;
+		out[count++].name = digest_cache_names_add(names, NULL, name);
+	}
+
+	return count;
+}
+
+/*
+ * Create any missing directories leading to the cache file, such as
+ * $XDG_CACHE_HOME/clean-dupes for the default cache.
+ */
+
+static void digest_cache_make_dirs(const char *path)
+{
+	char *dir;
+	char *p;
+
+	if (!path[0]) {
+		return;
+	}
+
+	dir = mem_strdup(path);
+
+	for (p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = 0;
+
+		if (mkdir(dir, S_IRWXU) && errno != EEXIST) {
+			debug("mkdir '%s' failed: %s\n", dir, strerror(errno));
+		}
+
+		*p = '/';
+	}
+
+	mem_free(dir);
+}
+
+int digest_cache_write(struct digest_cache *dc)
+{
+	struct digest_cache_names names = {.data = NULL};
+	struct digest_cache_header header;
+	struct digest_cache_entry *out;
+	uint64_t count;
+	uint64_t i;
+	char *tmp_path;
+	FILE *fp;
+	int result = 0;
+
+	if (dc->new_count) {
+		qsort(dc->new_entries, dc->new_count,
+			sizeof(dc->new_entries[0]), digest_cache_entry_compare);
+	}
+
+	for (i = 0, count = 0; i < dc->new_count; i++) {
+		if (count && !digest_cache_entry_compare(&dc->new_entries[i],
+			&dc->new_entries[count - 1])) {
+			continue;
+		}
+		dc->new_entries[count++] = dc->new_entries[i];
+	}
+	dc->new_count = count;
+
+	out = malloc((dc->count + dc->new_count + 1) * sizeof(*out));
+
+	if (!out) {
+		on_error("malloc failed.\n");
+	}
+
+	count = digest_cache_merge(dc, out, &names);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, digest_cache_magic, sizeof(header.magic));
+	header.version = digest_cache_version;
+	header.entry_size = sizeof(struct digest_cache_entry);
+	header.count = count;
+	header.names_size = names.len;
+
+	digest_cache_make_dirs(dc->path);
+	tmp_path = mem_strdupcat(dc->path, ".tmp");
+
+	fp = fopen(tmp_path, "w");
+
+	if (!fp) {
+		log("ERROR: fopen '%s' failed: %s\n", tmp_path,
+			strerror(errno));
+		result = -1;
+		goto exit;
+	}
+
+	if (fwrite(&header, sizeof(header), 1, fp) != 1
+		|| (count && fwrite(out, sizeof(out[0]), count, fp) != count)
+		|| (names.len && fwrite(names.data, names.len, 1, fp) != 1)) {
+		log("ERROR: fwrite '%s' failed: %s\n", tmp_path,
+			strerror(errno));
+		fclose(fp);
+		unlink(tmp_path);
+		result = -1;
+		goto exit;
+	}
+
+	if (fclose(fp) || rename(tmp_path, dc->path)) {
+		log("ERROR: writing '%s' failed: %s\n", dc->path,
+			strerror(errno));
+		unlink(tmp_path);
+		result = -1;
+	}
+
+exit:
+	mem_free(tmp_path);
+	free(names.data);
+	free(out);
+	return result;
+}
+
+void digest_cache_close(struct digest_cache *dc)
+{
+	debug("hits = %lu, misses = %lu, pruned = %lu\n", dc->hits,
+		dc->misses, dc->pruned);
+
+	if (dc->entries) {
+		mapped_file_unmap(&dc->mfi);
+	}
+
+	if (dc->states) {
+		mem_free(dc->states);
+	}
+
+	free(dc->new_entries);
+	free(dc->new_names.data);
+	free(dc->cwd);
+	mtx_destroy(&dc->mtx);
+	mem_free(dc->path);
+	mem_free(dc);
+}
+
+/*
+ * Digest stored in a user extended attribute of the file itself, so it
+ * follows the data across hosts.  Only the size and mtime are checked, the
+ * ctime changes when the attribute is written.
+ */
+
+static const char digest_xattr_name[] = "user.clean-dupes.digest";
+static const uint32_t digest_xattr_version = 2;
+
+struct digest_xattr {
+	uint32_t version;
+	uint32_t type;
+	uint64_t size;
+	uint64_t mtime_ns;
+	struct digest digest;
+};
+
+bool digest_xattr_load(int fd, uint64_t size, uint64_t mtime_ns,
+	struct digest *digest)
+{
+	struct digest_xattr xattr;
+	ssize_t result;
+
+	result = fgetxattr(fd, digest_xattr_name, &xattr, sizeof(xattr));
+
+	if (result != sizeof(xattr)) {
+		return false;
+	}
+
+	if (xattr.version != digest_xattr_version
+		|| xattr.type != (uint32_t)digest->type
+		|| xattr.digest.type != digest->type
+		|| xattr.size != size || xattr.mtime_ns != mtime_ns) {
+		debug("stale xattr\n");
+		return false;
+	}
+
+	*digest = xattr.digest;
+	return true;
+}
+
+void digest_xattr_store(int fd, uint64_t size, uint64_t mtime_ns,
+	const struct digest *digest)
+{
+	struct digest_xattr xattr;
+	int result;
+
+	memset(&xattr, 0, sizeof(xattr));
+	xattr.version = digest_xattr_version;
+	xattr.type = digest->type;
+	xattr.size = size;
+	xattr.mtime_ns = mtime_ns;
+	xattr.digest = *digest;
+
+	result = fsetxattr(fd, digest_xattr_name, &xattr, sizeof(xattr), 0);
+
+	if (result) {
+		debug("fsetxattr failed: %s\n", strerror(errno));
+	}
+}
@@ -0,0 +1,67 @@
+/*
+ *  Persistent digest cache.
+ */
+
+#if !defined(_LIB_DIGEST_CACHE_H)
+#define _LIB_DIGEST_CACHE_H
+
+#include <stdint.h>
+#include <threads.h>
+
+#include "digest.h"
+#include "mmap.h"
+
+struct digest_cache_key {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	uint64_t mtime_ns;
+	uint64_t ctime_ns;
+};
+
+struct digest_cache_entry {
+	struct digest_cache_key key;
+	struct digest digest;
+	uint64_t name;
+};
+
+struct digest_cache_names {
+	char *data;
+	uint64_t len;
+	uint64_t size;
+};
+
+struct digest_cache {
+	char *path;
+	char *cwd;
+	struct mapped_file_info mfi;
+	const struct digest_cache_entry *entries;
+	uint64_t count;
+	const char *names;
+	uint64_t names_size;
+	unsigned char *states;
+	mtx_t mtx;
+	struct digest_cache_entry *new_entries;
+	uint64_t new_count;
+	uint64_t new_size;
+	struct digest_cache_names new_names;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long pruned;
+};
+
+struct digest_cache *digest_cache_open(const char *path);
+bool digest_cache_lookup(struct digest_cache *dc,
+	const struct digest_cache_key *key, struct digest *digest);
+void digest_cache_insert(struct digest_cache *dc,
+	const struct digest_cache_key *key, const char *path,
+	const struct digest *digest);
+int digest_cache_write(struct digest_cache *dc);
+void digest_cache_close(struct digest_cache *dc);
+
+bool digest_xattr_load(int fd, uint64_t size, uint64_t mtime_ns,
+	struct digest *digest);
+void digest_xattr_store(int fd, uint64_t size, uint64_t mtime_ns,
+	const struct digest *digest);
+
+#endif /* _LIB_DIGEST_CACHE_H */
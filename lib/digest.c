@@ -10,6 +10,13 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
 
 #if defined(HAVE_MURMURHASH_H)
 # include <murmurhash.h>
@@ -17,59 +24,235 @@
 
 #include <openssl/evp.h>
 
+/*
+ * xxHash 0.8.2, see lib/xxhash.h.  XXH3 picks its vector code (SSE2, AVX2,
+ * AVX512, NEON and others) at compile time from the target flags, there is no
+ * runtime dispatch.  A default x86-64 build uses SSE2.
+ */
+#define XXH_INLINE_ALL
+#include "xxhash.h"
+
+#include "blake3.h"
 #include "digest.h"
 #include "log.h"
+#include "mem.h"
 #include "mmap.h"
+#include "work-queue.h"
+
+static const struct digest_type_info {
+	enum digest_type type;
+	const char *name;
+	bool available;
+} digest_types[] = {
+	{digest_type_md5sum, "md5", true},
+#if defined(HAVE_MURMURHASH_H)
+	{digest_type_mmhash, "mmhash", true},
+#else
+	{digest_type_mmhash, "mmhash", false},
+#endif
+	{digest_type_xxh128, "xxh128", true},
+	{digest_type_blake3, "blake3", true},
+	{digest_type_sha256, "sha256", true},
+	{digest_type_sha512_256, "sha512-256", true},
+	{digest_type_blake3_tree, "blake3-tree", true},
+};
+
+#if defined(HAVE_MURMURHASH_H)
+static enum digest_type digest_default_type = digest_type_mmhash;
+#else
+static enum digest_type digest_default_type = digest_type_md5sum;
+#endif
+
+static const struct digest_type_info *digest_type_info(enum digest_type type)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(digest_types) / sizeof(digest_types[0]); i++) {
+		if (digest_types[i].type == type) {
+			return &digest_types[i];
+		}
+	}
+	return NULL;
+}
+
+bool digest_type_available(enum digest_type type)
+{
+	const struct digest_type_info *info = digest_type_info(type);
+
+	return info && info->available;
+}
+
+bool digest_type_from_name(const char *name, enum digest_type *type)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(digest_types) / sizeof(digest_types[0]); i++) {
+		if (!strcmp(digest_types[i].name, name)) {
+			*type = digest_types[i].type;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char *digest_type_name(enum digest_type type)
+{
+	const struct digest_type_info *info = digest_type_info(type);
+
+	return info ? info->name : "unknown";
+}
+
+void digest_set_default_type(enum digest_type type)
+{
+	if (!digest_type_available(type)) {
+		log("ERROR: Digest type not available: %s\n",
+			digest_type_name(type));
+		assert(0);
+		exit(EXIT_FAILURE);
+	}
+
+	digest_default_type = type;
+}
+
+enum digest_type digest_get_default_type(void)
+{
+	return digest_default_type;
+}
 
 void digest_init_type(struct digest *digest, enum digest_type type)
 {
-	if (type != digest_type_md5sum && type != digest_type_mmhash) {
+	if (!digest_type_available(type)) {
 		log("ERROR: Bad digest type: %d\n", type);
 		assert(0);
 		exit(EXIT_FAILURE);
 	}
 
 	digest->type = type;
-	digest->data[0] = 0;
+	digest->data[0] = digest->data[1] = 0;
+	digest->data[2] = digest->data[3] = 0;
 	//debug("type = %d\n", digest->type);
 }
 
-static void digest_md5sum_file(struct digest *digest,
-	struct mapped_file_info *mfi)
-{
-	unsigned int digest_len;
-	EVP_MD_CTX *ctx;
+/*
+ * Streaming digest state, for all types but mmhash which can only hash a
+ * whole buffer.  OpenSSL picks the fastest implementation for the CPU, like
+ * the SHA extensions for SHA-256 where they are available.
+ */
 
-	debug("\n");
+struct digest_ctx {
+	struct digest *digest;
+	union {
+		EVP_MD_CTX *evp;
+		XXH3_state_t *xxh3;
+		struct blake3_hasher blake3;
+	} u;
+};
 
-	assert(digest->type == digest_type_md5sum);
+static const EVP_MD *digest_evp_md(enum digest_type type)
+{
+	switch (type) {
+	case digest_type_md5sum:
+		return EVP_md5();
+	case digest_type_sha256:
+		return EVP_sha256();
+	case digest_type_sha512_256:
+		return EVP_sha512_256();
+	default:
+		return NULL;
+	}
+}
 
-	ctx = EVP_MD_CTX_create();
+static void digest_ctx_init(struct digest_ctx *ctx, struct digest *digest)
+{
+	const EVP_MD *md = digest_evp_md(digest->type);
+
+	ctx->digest = digest;
 
-	EVP_DigestInit(ctx, EVP_md5());
-	EVP_DigestUpdate(ctx, mfi->addr, mfi->size);
-	EVP_DigestFinal(ctx, (void *)digest->data, &digest_len);
+	if (md) {
+		ctx->u.evp = EVP_MD_CTX_create();
+		EVP_DigestInit(ctx->u.evp, md);
+		return;
+	}
 
-	EVP_MD_CTX_destroy(ctx);
+	switch (digest->type) {
+	case digest_type_xxh128:
+		ctx->u.xxh3 = XXH3_createState();
 
-	if (digest_len != sizeof(digest->data)) {
-		log("ERROR: Bad digest length: %u != %lu\n", digest_len,
-			sizeof(digest->data));
+		if (!ctx->u.xxh3) {
+			log("ERROR: XXH3_createState failed.\n");
+			exit(EXIT_FAILURE);
+		}
+		XXH3_128bits_reset(ctx->u.xxh3);
+		break;
+	case digest_type_blake3:
+		blake3_init(&ctx->u.blake3);
+		break;
+	default:
+		log("Internal error: %d\n", digest->type);
 		assert(0);
 		exit(EXIT_FAILURE);
 	}
 }
 
-int digest_hash_file(struct digest *digest, const char *file)
+static void digest_ctx_update(struct digest_ctx *ctx, const void *addr,
+	size_t size)
 {
-	struct mapped_file_info mfi;
+	switch (ctx->digest->type) {
+	case digest_type_xxh128:
+		XXH3_128bits_update(ctx->u.xxh3, addr, size);
+		break;
+	case digest_type_blake3:
+		blake3_update(&ctx->u.blake3, addr, size);
+		break;
+	default:
+		EVP_DigestUpdate(ctx->u.evp, addr, size);
+		break;
+	}
+}
 
-	mapped_file_map(&mfi, file);
+static void digest_ctx_final(struct digest_ctx *ctx)
+{
+	struct digest *digest = ctx->digest;
+	unsigned int digest_len;
 
 	switch (digest->type) {
-	case digest_type_md5sum:
-		debug("'%s' digest_type_md5sum\n", file);
-		digest_md5sum_file(digest, &mfi);
+	case digest_type_xxh128:
+	{
+		XXH128_hash_t hash = XXH3_128bits_digest(ctx->u.xxh3);
+
+		digest->data[0] = hash.low64;
+		digest->data[1] = hash.high64;
+		XXH3_freeState(ctx->u.xxh3);
+		break;
+	}
+	case digest_type_blake3:
+		blake3_final(&ctx->u.blake3, digest->data,
+			2 * sizeof(digest->data[0]));
+		break;
+	default:
+		EVP_DigestFinal(ctx->u.evp, (void *)digest->data, &digest_len);
+		EVP_MD_CTX_destroy(ctx->u.evp);
+
+		if (digest_len > sizeof(digest->data)) {
+			log("ERROR: Bad digest length: %u\n", digest_len);
+			assert(0);
+			exit(EXIT_FAILURE);
+		}
+		break;
+	}
+}
+
+static void digest_hash_tree(struct digest *digest, int fd, const void *addr,
+	uint64_t size, const char *file);
+
+static void digest_hash_buffer(struct digest *digest, const void *addr,
+	size_t size, const char *file)
+{
+	struct digest_ctx ctx;
+
+	switch (digest->type) {
+	case digest_type_blake3_tree:
+		digest_hash_tree(digest, -1, addr, size, file);
 		break;
 
 #if defined(HAVE_MURMURHASH_H)
@@ -78,36 +261,453 @@ int digest_hash_file(struct digest *digest, const char *file)
 		static const uint32_t mmhash_seed = 0;
 
 		//debug("'%s' digest_type_mmhash\n", file);
-		lmmh_x64_128(mfi.addr, mfi.size, mmhash_seed, (uint64_t *)digest->data);
+		lmmh_x64_128(addr, size, mmhash_seed, (uint64_t *)digest->data);
 		break;
 	}
 #endif
 
-	default:
-		log("Internal error: %d\n", digest->type);
-		assert(0);
-		exit(EXIT_FAILURE);
+	case digest_type_xxh128:
+	{
+		XXH128_hash_t hash = XXH3_128bits(addr, size);
+
+		digest->data[0] = hash.low64;
+		digest->data[1] = hash.high64;
+		break;
 	}
 
-	mapped_file_unmap(&mfi);
+	default:
+		digest_ctx_init(&ctx, digest);
+		digest_ctx_update(&ctx, addr, size);
+		digest_ctx_final(&ctx);
+		break;
+	}
 
 	if (0) {
 		struct digest_str s;
 		digest_sprint(digest, &s);
 		debug("done: '%s' = %s\n", file, s.str);
 	}
+}
+
+/*
+ * Files are either mapped whole or read with pread through a reusable
+ * per-thread buffer.  Mapping saves a copy, but on very large files the
+ * page faults and TLB misses cost more than the copy, and on small files
+ * the map and unmap cost more than a read.  Auto mode maps files between
+ * digest_mmap_min and digest_mmap_max bytes.  mmhash can't be streamed, so
+ * it always maps.
+ *
+ * Direct mode reads with O_DIRECT and O_NOATIME so hashing leaves the page
+ * cache and access times alone.  When the filesystem doesn't support
+ * O_DIRECT the file is read normally and its pages are dropped afterwards
+ * with POSIX_FADV_DONTNEED.  O_NOATIME is skipped for files the user doesn't
+ * own.
+ */
+
+static const size_t digest_io_buf_size = 1024 * 1024;
+static const size_t digest_io_align = 4096;
+static const uint64_t digest_mmap_min = 256 * 1024;
+static const uint64_t digest_mmap_max = 1024 * 1024 * 1024;
+
+static const char *const digest_io_names[] = {
+	[digest_io_auto] = "auto",
+	[digest_io_mmap] = "mmap",
+	[digest_io_read] = "read",
+	[digest_io_direct] = "direct",
+};
+
+static enum digest_io digest_io = digest_io_auto;
+
+/*
+ * The aligned buffer for read and direct hashing is allocated on first use in
+ * each thread and registered with digest_io_key, whose destructor frees it
+ * when the thread exits.
+ */
+static __thread void *digest_io_buf;
+static once_flag digest_io_key_once = ONCE_FLAG_INIT;
+static tss_t digest_io_key;
+
+bool digest_io_from_name(const char *name, enum digest_io *io)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(digest_io_names) / sizeof(digest_io_names[0]);
+		i++) {
+		if (!strcmp(digest_io_names[i], name)) {
+			*io = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char *digest_io_name(enum digest_io io)
+{
+	return digest_io_names[io];
+}
+
+void digest_set_io(enum digest_io io)
+{
+	digest_io = io;
+}
+
+static void digest_io_release(void *buf)
+{
+	free(buf);
+	digest_io_buf = NULL;
+}
+
+static void digest_io_key_init(void)
+{
+	if (tss_create(&digest_io_key, digest_io_release) != thrd_success) {
+		on_error("tss_create.\n");
+	}
+}
+
+static void *digest_io_buffer(void)
+{
+	if (!digest_io_buf) {
+		int result;
+
+		call_once(&digest_io_key_once, digest_io_key_init);
+		result = posix_memalign(&digest_io_buf, digest_io_align,
+			digest_io_buf_size);
+
+		if (result) {
+			log("ERROR: posix_memalign failed: %s\n",
+				strerror(result));
+			exit(EXIT_FAILURE);
+		}
+
+		if (tss_set(digest_io_key, digest_io_buf) != thrd_success) {
+			on_error("tss_set.\n");
+		}
+	}
+	return digest_io_buf;
+}
+
+static bool digest_fd_add_flags(int fd, int flags)
+{
+	int result = fcntl(fd, F_GETFL);
+
+	return result >= 0 && !fcntl(fd, F_SETFL, result | flags);
+}
+
+static void digest_direct_on(int fd, bool direct)
+{
+	if (direct) {
+		if (digest_fd_add_flags(fd, O_DIRECT | O_NOATIME)
+			|| digest_fd_add_flags(fd, O_DIRECT)) {
+			return;
+		}
+	}
+	digest_fd_add_flags(fd, O_NOATIME);
+}
+
+/*
+ * Some filesystems accept O_DIRECT but fail the read.  Returns true if the
+ * fd was switched back to buffered reads.
+ */
+
+static bool digest_direct_off(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0 || !(flags & O_DIRECT)) {
+		return false;
+	}
+	return !fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+}
+
+static void digest_direct_done(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0 || !(flags & O_DIRECT)) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+}
+
+static size_t digest_pread(int fd, void *buf, size_t len, uint64_t offset,
+	const char *file)
+{
+	size_t count = 0;
+
+	while (count < len) {
+		ssize_t result = pread(fd, (char *)buf + count, len - count,
+			offset + count);
+
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EINVAL && digest_direct_off(fd)) {
+				continue;
+			}
+			log("ERROR: pread '%s' failed: %s\n", file,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if (!result) {
+			break;
+		}
+		count += result;
+	}
+
+	return count;
+}
+
+/*
+ * The blake3-tree digest splits a file into digest_tree_leaf_size leaves,
+ * hashes the leaves in parallel on the work queue of the calling thread and
+ * takes a BLAKE3 hash of the leaf hashes and the file size.  It never equals
+ * the linear BLAKE3 digest of the same data, which is why it is a separate
+ * digest type.
+ */
+
+static const uint64_t digest_tree_leaf_size = 64 * 1024 * 1024;
+
+struct digest_tree {
+	int fd;
+	const uint8_t *addr;
+	uint64_t size;
+	const char *file;
+	uint8_t (*leaves)[blake3_out_len];
+};
+
+static void digest_tree_leaf(void *arg, unsigned int index)
+{
+	struct digest_tree *tree = arg;
+	uint64_t offset = index * digest_tree_leaf_size;
+	uint64_t len = tree->size - offset;
+	struct blake3_hasher hasher;
+
+	if (len > digest_tree_leaf_size) {
+		len = digest_tree_leaf_size;
+	}
+
+	blake3_init(&hasher);
+
+	if (tree->addr) {
+		blake3_update(&hasher, tree->addr + offset, len);
+	} else {
+		void *buf = digest_io_buffer();
+
+		while (len) {
+			size_t count = len < digest_io_buf_size ? len
+				: digest_io_buf_size;
+
+			/* O_DIRECT reads must be block sized, even at EOF. */
+			count = digest_pread(tree->fd, buf,
+				(count + digest_io_align - 1)
+				& ~(digest_io_align - 1), offset, tree->file);
+
+			if (!count) {
+				break;
+			}
+			if (count > len) {
+				count = len;
+			}
+
+			blake3_update(&hasher, buf, count);
+			offset += count;
+			len -= count;
+		}
+	}
+
+	blake3_final(&hasher, tree->leaves[index], blake3_out_len);
+}
+
+static void digest_hash_tree(struct digest *digest, int fd, const void *addr,
+	uint64_t size, const char *file)
+{
+	struct digest_tree tree = {
+		.fd = fd,
+		.addr = addr,
+		.size = size,
+		.file = file,
+	};
+	struct blake3_hasher hasher;
+	unsigned int count;
+	uint8_t size_le[8];
+	unsigned int i;
+
+	count = size ? (size + digest_tree_leaf_size - 1)
+		/ digest_tree_leaf_size : 1;
+
+	tree.leaves = mem_alloc(count * sizeof(tree.leaves[0]));
+
+	work_queue_parallel_for(count, digest_tree_leaf, &tree);
+
+	for (i = 0; i < sizeof(size_le); i++) {
+		size_le[i] = size >> (8 * i);
+	}
+
+	blake3_init(&hasher);
+	blake3_update(&hasher, tree.leaves, count * sizeof(tree.leaves[0]));
+	blake3_update(&hasher, size_le, sizeof(size_le));
+	blake3_final(&hasher, digest->data, 2 * sizeof(digest->data[0]));
+
+	mem_free(tree.leaves);
+}
+
+static bool digest_use_mmap(const struct digest *digest, int fd,
+	const char *file)
+{
+	struct stat st;
+
+	if (digest->type == digest_type_mmhash) {
+		return true;
+	}
+
+	switch (digest_io) {
+	case digest_io_mmap:
+		return true;
+	case digest_io_read:
+	case digest_io_direct:
+		return false;
+	case digest_io_auto:
+		break;
+	}
+
+	if (fstat(fd, &st)) {
+		log("ERROR: fstat '%s' failed: %s\n", file, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	return S_ISREG(st.st_mode) && (uint64_t)st.st_size >= digest_mmap_min
+		&& (uint64_t)st.st_size <= digest_mmap_max;
+}
+
+static void digest_hash_read(struct digest *digest, int fd, const char *file)
+{
+	void *buf = digest_io_buffer();
+	struct digest_ctx ctx;
+	uint64_t offset = 0;
+
+	digest_ctx_init(&ctx, digest);
+
+	while (1) {
+		size_t count = digest_pread(fd, buf, digest_io_buf_size, offset,
+			file);
+
+		digest_ctx_update(&ctx, buf, count);
+		offset += count;
+
+		if (count < digest_io_buf_size) {
+			break;
+		}
+	}
+
+	digest_ctx_final(&ctx);
+}
+
+int digest_hash_fd(struct digest *digest, int fd, const char *file)
+{
+	struct mapped_file_info mfi;
+
+	if (digest_io == digest_io_direct) {
+		digest_direct_on(fd, digest->type != digest_type_mmhash);
+	}
+
+	if (digest->type == digest_type_blake3_tree) {
+		struct stat st;
+
+		if (fstat(fd, &st)) {
+			log("ERROR: fstat '%s' failed: %s\n", file,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		digest_hash_tree(digest, fd, NULL, st.st_size, file);
+	} else if (digest_use_mmap(digest, fd, file)) {
+		mapped_file_map_fd(&mfi, fd, file);
+		digest_hash_buffer(digest, mfi.addr, mfi.size, file);
+		mapped_file_unmap(&mfi);
+	} else {
+		digest_hash_read(digest, fd, file);
+	}
+
+	if (digest_io == digest_io_direct) {
+		digest_direct_done(fd);
+	}
 
 	return 0;
 }
 
+int digest_hash_file(struct digest *digest, const char *file)
+{
+	int fd;
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		log("ERROR: open '%s' failed: %s\n", file, strerror(errno));
+		assert(0);
+		exit(EXIT_FAILURE);
+	}
+
+	digest_hash_fd(digest, fd, file);
+	close(fd);
+
+	return 0;
+}
+
+/*
+ * Hash len bytes of an open file starting at offset.  The data is read into
+ * the per-thread I/O buffer, so len is limited to digest_range_max.  Returns
+ * the number of bytes hashed, which is short if the file has been truncated.
+ */
+
+size_t digest_hash_range(struct digest *digest, int fd, uint64_t offset,
+	size_t len, const char *file)
+{
+	void *buf = digest_io_buffer();
+	size_t count;
+
+	assert(len <= digest_range_max);
+
+	if (digest_io == digest_io_direct) {
+		digest_direct_on(fd, false);
+	}
+
+	count = digest_pread(fd, buf, len, offset, file);
+	digest_hash_buffer(digest, buf, count, file);
+
+	if (digest_io == digest_io_direct) {
+		digest_direct_done(fd);
+	}
+
+	return count;
+}
+
+static unsigned int digest_words(const struct digest *digest)
+{
+	switch (digest->type) {
+	case digest_type_sha256:
+	case digest_type_sha512_256:
+		return 4;
+	default:
+		return 2;
+	}
+}
+
 int digest_sprint(const struct digest *digest, struct digest_str *digest_str)
 {
-	return sprintf(digest_str->str, "%" PRIx64 "%" PRIx64 "",
-		digest->data[0], digest->data[1]);
+	unsigned int words = digest_words(digest);
+	unsigned int i;
+	int len = 0;
+
+	for (i = 0; i < words; i++) {
+		len += sprintf(digest_str->str + len, "%016" PRIx64,
+			digest->data[i]);
+	}
+	return len;
 }
 
 int digest_fprint(const struct digest *digest, FILE *fp)
 {
-	return fprintf(fp, "%" PRIx64 "%" PRIx64 "", digest->data[0],
-		digest->data[1]);
+	struct digest_str s;
+
+	digest_sprint(digest, &s);
+	return fputs(s.str, fp) < 0 ? -1 : (int)strlen(s.str);
 }
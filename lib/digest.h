@@ -12,42 +12,74 @@
 enum digest_type {
 	digest_type_md5sum = 111,
 	digest_type_mmhash,
+	digest_type_xxh128,
+	digest_type_blake3,
+	digest_type_sha256,
+	digest_type_sha512_256,
+	digest_type_blake3_tree,
 };
 
+/*
+ * Digests of up to 256 bits.  128 bit digests leave the upper two words
+ * zero, so digest_compare() usually decides on the first two words.
+ */
+
 struct digest {
-	uint64_t data[2];
+	uint64_t data[4];
 	enum digest_type type;
 };
 
+enum {digest_range_max = 64 * 1024};
+
+enum digest_io {
+	digest_io_auto,
+	digest_io_mmap,
+	digest_io_read,
+	digest_io_direct,
+};
+
 struct digest_str {
-	char str[32 + 1];
+	char str[64 + 1];
 };
 
 void digest_init_type(struct digest *digest, enum digest_type type);
+bool digest_type_available(enum digest_type type);
+bool digest_type_from_name(const char *name, enum digest_type *type);
+const char *digest_type_name(enum digest_type type);
+void digest_set_default_type(enum digest_type type);
+enum digest_type digest_get_default_type(void);
 int digest_hash_file(struct digest *digest, const char *file);
+int digest_hash_fd(struct digest *digest, int fd, const char *file);
+bool digest_io_from_name(const char *name, enum digest_io *io);
+const char *digest_io_name(enum digest_io io);
+void digest_set_io(enum digest_io io);
+size_t digest_hash_range(struct digest *digest, int fd, uint64_t offset,
+	size_t len, const char *file);
 int digest_sprint(const struct digest *digest, struct digest_str *digest_str);
 int digest_fprint(const struct digest *digest, FILE *fp);
 
 static inline void digest_init(struct digest *digest)
 {
-#if defined(HAVE_MURMURHASH_H)
-	digest->type = digest_type_mmhash;
-#else
-	digest->type = digest_type_md5sum;
-#endif
+	digest->type = digest_get_default_type();
 	digest->data[0] = digest->data[1] = 0;
+	digest->data[2] = digest->data[3] = 0;
 }
 
 static inline bool digest_is_empty(const struct digest *digest)
 {
-	return !digest->data[0] && !digest->data[1];
+	return !digest->data[0] && !digest->data[1] && !digest->data[2]
+		&& !digest->data[3];
 }
 
 static inline bool digest_compare(const struct digest *digest1,
 	const struct digest *digest2)
 {
-	return (digest1->data[0] == digest2->data[0]
-		&& digest1->data[1] == digest2->data[1]);
+	if (digest1->data[0] != digest2->data[0]
+		|| digest1->data[1] != digest2->data[1]) {
+		return false;
+	}
+	return (digest1->data[2] == digest2->data[2]
+		&& digest1->data[3] == digest2->data[3]);
 }
 
 static inline void digest_print(const struct digest *digest)
@@ -0,0 +1,29 @@
+/*
+ *  Directory reader.
+ */
+
+#if !defined(_LIB_DIR_READER_H)
+#define _LIB_DIR_READER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct dir_reader_entry {
+	uint64_t ino;
+	unsigned char type;
+	const char *name;
+};
+
+struct dir_reader {
+	int fd;
+	char *buf;
+	size_t len;
+	size_t pos;
+};
+
+void dir_reader_init(struct dir_reader *dr, int fd);
+bool dir_reader_fill(struct dir_reader *dr, const char *path);
+bool dir_reader_next(struct dir_reader *dr, struct dir_reader_entry *entry);
+
+#endif /* _LIB_DIR_READER_H */
@@ -3,120 +3,434 @@
  */
 
 #include <assert.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
 
 #include "hash-table.h"
+#include "list.h"
 #include "log.h"
 #include "mem.h"
 
+static const unsigned int hash_table_shard_min = 16;
+static const unsigned int hash_table_vector_min = 4;
+static const unsigned int hash_table_migrate_step = 8;
+
+/*
+ * File sizes are far from random: block aligned sizes share all their low
+ * bits.  The murmur3 64 bit finalizer mixes every key bit into every hash
+ * bit, so the low bits used for the shard and slot are evenly spread.
+ */
+
+static inline uint64_t hash_table_hash(unsigned long key)
+{
+	uint64_t h = key;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static inline struct hash_table_shard *hash_table_shard(
+	const struct hash_table *ht, uint64_t hash)
+{
+	return (struct hash_table_shard *)&ht->shards[hash
+		& (hash_table_shard_count - 1)];
+}
+
+static inline unsigned int hash_table_pos(unsigned int mask, uint64_t hash)
+{
+	return (unsigned int)(hash / hash_table_shard_count) & mask;
+}
+
+static void hash_table_shard_init(struct hash_table_shard *shard,
+	unsigned int size)
+{
+	int result;
+
+	result = mtx_init(&shard->mtx, mtx_plain);
+
+	if (result) {
+		on_error("mtx_init.\n");
+	}
+
+	shard->mask = size - 1;
+	shard->used = 0;
+	shard->slots = mem_alloc_zero(size * sizeof(shard->slots[0]));
+}
+
+/* Returns the slot for key, or the free slot where it would go. */
+
+static struct hash_table_slot *hash_table_probe(struct hash_table_slot *slots,
+	unsigned int mask, unsigned long key, uint64_t hash)
+{
+	unsigned int pos = hash_table_pos(mask, hash);
+
+	while (1) {
+		struct hash_table_slot *slot = &slots[pos];
+
+		if (!slot->count || slot->key == key) {
+			return slot;
+		}
+		pos = (pos + 1) & mask;
+	}
+}
+
+/*
+ * A shard grows by allocating a slot array twice the size and then moving
+ * the old slots over a few at a time on each following insert, so no single
+ * insert pays for rehashing the whole shard.  Old slots below migrate_pos
+ * have been moved.  The old array is left intact until the move is done,
+ * so its probe sequences stay valid for lookups.
+ */
+
+static void hash_table_shard_migrate(struct hash_table_shard *shard,
+	unsigned int count)
+{
+	while (shard->old_slots && count--) {
+		const struct hash_table_slot *old;
+
+		if (shard->migrate_pos > shard->old_mask) {
+			mem_free(shard->old_slots);
+			shard->old_slots = NULL;
+			break;
+		}
+
+		old = &shard->old_slots[shard->migrate_pos++];
+
+		if (old->count) {
+			*hash_table_probe(shard->slots, shard->mask, old->key,
+				hash_table_hash(old->key)) = *old;
+		}
+	}
+}
+
+static void hash_table_shard_grow(struct hash_table_shard *shard)
+{
+	unsigned int size = 2 * (shard->mask + 1);
+
+	hash_table_shard_migrate(shard, UINT_MAX);
+
+	shard->old_slots = shard->slots;
+	shard->old_mask = shard->mask;
+	shard->migrate_pos = 0;
+	shard->grows++;
+
+	shard->mask = size - 1;
+	shard->slots = mem_alloc_zero(size * sizeof(shard->slots[0]));
+}
+
+/*
+ * Returns the slot of key, looking in the old array while a migration is in
+ * progress.  Returns a free slot in the new array if the key is not found.
+ */
+
+static struct hash_table_slot *hash_table_shard_lookup(
+	struct hash_table_shard *shard, unsigned long key, uint64_t hash)
+{
+	if (shard->old_slots) {
+		struct hash_table_slot *old = hash_table_probe(
+			shard->old_slots, shard->old_mask, key, hash);
+
+		if (old->count && (unsigned int)(old - shard->old_slots)
+			>= shard->migrate_pos) {
+			return old;
+		}
+	}
+
+	return hash_table_probe(shard->slots, shard->mask, key, hash);
+}
+
+static void hash_table_slot_add(struct hash_table_slot *slot, void *value)
+{
+	if (!slot->count) {
+		slot->value = value;
+	} else {
+		if (slot->count == 1) {
+			void *first = slot->value;
+
+			slot->alloc = hash_table_vector_min;
+			slot->values = mem_alloc(slot->alloc
+				* sizeof(slot->values[0]));
+			slot->values[0] = first;
+		} else if (slot->count == slot->alloc) {
+			void **values = slot->values;
+
+			slot->alloc *= 2;
+			slot->values = mem_alloc(slot->alloc
+				* sizeof(slot->values[0]));
+			memcpy(slot->values, values, slot->count
+				* sizeof(slot->values[0]));
+			mem_free(values);
+		}
+		slot->values[slot->count] = value;
+	}
+	slot->count++;
+}
+
+static unsigned int hash_table_round_pow2(unsigned int count)
+{
+	unsigned int size;
+
+	for (size = 1; size < count; size *= 2) {
+		;
+	}
+	return size;
+}
+
+/*
+ * The initial count is spread over the shards, each shard rounded up to a
+ * power of two so the slot position can be masked from the hash.
+ */
+
 struct hash_table *hash_table_init(unsigned int count)
 {
 	struct hash_table *ht;
+	unsigned int size;
 	unsigned int i;
 
 	if (count < 1) {
 		on_error("too small.\n");
 	}
 
-	ht = mem_alloc_zero(sizeof(*ht) + count * sizeof(ht->array[0]));
+	size = hash_table_round_pow2(count / hash_table_shard_count);
 
-	list_init(&ht->extras, "ht extras");
+	if (size < hash_table_shard_min) {
+		size = hash_table_shard_min;
+	}
 
-	ht->count = count;
+	ht = mem_alloc_aligned_zero(__alignof__(*ht), sizeof(*ht));
 
-	for (i = 0; i < ht->count; i++) {
-		list_init(&ht->array[i], "ht list");
+	for (i = 0; i < hash_table_shard_count; i++) {
+		hash_table_shard_init(&ht->shards[i], size);
 	}
 
 	return ht;
 }
 
-void hash_table_entry_init(struct hash_table_entry *hte, struct list *list,
-	unsigned long key, void *data)
+/* Frees the table and its value vectors, but not the values. */
+
+void hash_table_delete(struct hash_table *ht)
 {
-	hte->my_list = list;
-	hte->key = key;
-	hte->data = data;
-	list_entry_init(hte->my_list, &hte->list_entry);
+	unsigned int i;
+	unsigned int j;
+
+	for (i = 0; i < hash_table_shard_count; i++) {
+		struct hash_table_shard *shard = &ht->shards[i];
+
+		hash_table_shard_migrate(shard, UINT_MAX);
+
+		for (j = 0; j <= shard->mask; j++) {
+			if (shard->slots[j].count > 1) {
+				mem_free(shard->slots[j].values);
+			}
+		}
+
+		mem_free(shard->slots);
+		mtx_destroy(&shard->mtx);
+	}
+
+	mem_free_aligned(ht);
 }
 
-void hash_table_insert(struct hash_table *ht, unsigned int index,
-	struct hash_table_entry *hte)
+/*
+ * Add value to the vector of key.  Returns the first value inserted with the
+ * same key, or NULL if this is the first.  The lookup and the insert are done
+ * under one shard lock, so of several threads inserting the same key exactly
+ * one gets NULL.
+ */
+
+void *hash_table_insert(struct hash_table *ht, unsigned long key,
+	void *value)
 {
-	//debug("index-%u: %lu => %p\n", index, hte->key, hte->data);
+	uint64_t hash = hash_table_hash(key);
+	struct hash_table_shard *shard = hash_table_shard(ht, hash);
+	struct hash_table_slot *slot;
+	void *first;
+
+	list_lock(&shard->mtx);
+
+	hash_table_shard_migrate(shard, hash_table_migrate_step);
+
+	slot = hash_table_shard_lookup(shard, key, hash);
+
+	if (!slot->count) {
+		if (4 * (shard->used + 1) > 3 * (shard->mask + 1)) {
+			hash_table_shard_grow(shard);
+			slot = hash_table_probe(shard->slots, shard->mask, key,
+				hash);
+		}
+		slot->key = key;
+		shard->used++;
+	}
 
-	assert(index < ht->count);
-	assert(hte->list_entry.list_mtx);
+	first = slot->count ? hash_table_slot_values(slot)[0] : NULL;
+	hash_table_slot_add(slot, value);
 
-	list_add_tail(&ht->array[index], &hte->list_entry);
+	list_unlock(&shard->mtx);
+
+	return first;
 }
 
-void hash_table_insert_extra(struct hash_table *ht,
-	struct hash_table_entry *hte)
+/*
+ * Finish any migrations still in progress.  Must be called once all inserts
+ * are done and before the table is read with hash_table_find(),
+ * hash_table_for_each_slot() or directly through the shard slot arrays.
+ */
+
+void hash_table_settle(struct hash_table *ht)
 {
-	//debug("%u@%lu => %p\n", hte->data);
+	unsigned int i;
 
-	assert(hte->list_entry.list_mtx);
+	for (i = 0; i < hash_table_shard_count; i++) {
+		struct hash_table_shard *shard = &ht->shards[i];
 
-	list_add_tail(&ht->extras, &hte->list_entry);
+		list_lock(&shard->mtx);
+		hash_table_shard_migrate(shard, UINT_MAX);
+		list_unlock(&shard->mtx);
+	}
 }
 
-void hash_table_remove(struct hash_table_entry *hte)
+/* Lookup without locking, only for use on a settled table. */
+
+const struct hash_table_slot *hash_table_find(const struct hash_table *ht,
+	unsigned long key)
 {
-	list_remove(&hte->list_entry);
+	uint64_t hash = hash_table_hash(key);
+	const struct hash_table_shard *shard = hash_table_shard(ht, hash);
+	const struct hash_table_slot *slot;
+
+	assert(!shard->old_slots);
+
+	slot = hash_table_probe(shard->slots, shard->mask, key, hash);
+
+	return slot->count ? slot : NULL;
 }
 
-struct hash_table_entry *hash_table_find_first(struct hash_table *ht,
-	unsigned int index, unsigned long key)
+int hash_table_for_each_slot(const struct hash_table *ht,
+	hash_table_for_each_slot_cb cb_fn, void *cb_data)
 {
-	struct hash_table_entry *hte;
+	unsigned int i;
+	unsigned int j;
+	int result = 0;
 
-	assert(index < ht->count);
+	for (i = 0; i < hash_table_shard_count; i++) {
+		const struct hash_table_shard *shard = &ht->shards[i];
 
-	list_for_each(&ht->array[index], hte, list_entry) {
-		if (key == hte->key) {
-			debug("found    %u@%lu => %p\n", index, key,
-				hte->data);
-			return hte;
-		} else {
-			debug("check    %u@%lu => %p\n", index, key,
-				hte->data);
+		assert(!shard->old_slots);
+
+		for (j = 0; j <= shard->mask; j++) {
+			if (!shard->slots[j].count) {
+				continue;
+			}
+			result = cb_fn(cb_data, &shard->slots[j]);
+			if (result) {
+				return result;
+			}
 		}
 	}
+	return result;
+}
+
+/* Log2 histogram bucket of a value: 0, 1, 2-3, 4-7, ... */
+
+static unsigned int hash_table_hist_index(unsigned long value)
+{
+	unsigned int index = 0;
 
-	debug("not found %u@%lu\n", index, key);
-	return NULL;
+	while (value && index < hash_table_hist_size - 1) {
+		value >>= 1;
+		index++;
+	}
+	return index;
 }
 
-struct hash_table_entry *hash_table_find_next(
-	struct hash_table_entry *hte)
+static void hash_table_hist_print(FILE *fp, const char *name,
+	const unsigned long *hist)
 {
-	unsigned long key = hte->key;
+	unsigned int i;
+
+	fprintf(fp, "  %s:\n", name);
 
-	list_for_each_continue(hte->my_list, hte, list_entry) {
-		if (key == hte->key) {
-			debug("found    @%lu => %p\n", key, hte->data);
-			return hte;
+	for (i = 0; i < hash_table_hist_size; i++) {
+		unsigned long low = i ? 1UL << (i - 1) : 0;
+		unsigned long high = i ? (1UL << i) - 1 : 0;
+
+		if (!hist[i]) {
+			continue;
+		}
+
+		if (i == hash_table_hist_size - 1) {
+			fprintf(fp, "    %8lu+%8s %8lu\n", low, "", hist[i]);
 		} else {
-			debug("check    @%lu => %p\n", key, hte->data);
+			fprintf(fp, "    %8lu-%-8lu %8lu\n", low, high,
+				hist[i]);
 		}
 	}
-
-	debug("not found %lu\n", key);
-	return NULL;
 }
 
-int hash_table_for_each_list(const struct hash_table *ht,
-	hash_table_for_each_list_cb cb_fn, void *cb_data)
+/*
+ * Print slot occupancy, probe distances and the number of values per key.
+ * The probe distance of a slot is how far it sits from its home position,
+ * the open addressing equivalent of a chain length.
+ */
+
+void hash_table_print_stats(const struct hash_table *ht, FILE *fp)
 {
+	unsigned long probe_hist[hash_table_hist_size] = {0};
+	unsigned long count_hist[hash_table_hist_size] = {0};
+	unsigned long slots = 0;
+	unsigned long used = 0;
+	unsigned long values = 0;
+	unsigned int shard_min = UINT_MAX;
+	unsigned int shard_max = 0;
+	unsigned int grows = 0;
+	unsigned int probe_max = 0;
+	unsigned int count_max = 0;
 	unsigned int i;
-	int result = 0;
+	unsigned int j;
 
-	for (i = 0; i <  ht->count; i++) {
-		//debug("list [%u]\n", i);
-		result = cb_fn(cb_data, &(ht->array[i]));
-		if (result) {
-			break;
+	for (i = 0; i < hash_table_shard_count; i++) {
+		const struct hash_table_shard *shard = &ht->shards[i];
+
+		slots += shard->mask + 1;
+		grows += shard->grows;
+		used += shard->used;
+		shard_min = (shard->used < shard_min) ? shard->used : shard_min;
+		shard_max = (shard->used > shard_max) ? shard->used : shard_max;
+
+		for (j = 0; j <= shard->mask; j++) {
+			const struct hash_table_slot *slot = &shard->slots[j];
+			unsigned int probe;
+
+			if (!slot->count) {
+				continue;
+			}
+
+			probe = (j - hash_table_pos(shard->mask,
+				hash_table_hash(slot->key))) & shard->mask;
+
+			probe_hist[hash_table_hist_index(probe)]++;
+			count_hist[hash_table_hist_index(slot->count)]++;
+			probe_max = (probe > probe_max) ? probe : probe_max;
+			count_max = (slot->count > count_max)
+				? slot->count : count_max;
+			values += slot->count;
 		}
 	}
-	return result;
+
+	fprintf(fp, "Hash table stats:\n");
+	fprintf(fp, "  shards: %u, slots: %lu, used: %lu, values: %lu, grows: %u\n",
+		hash_table_shard_count, slots, used, values, grows);
+	fprintf(fp, "  empty ratio: %.3f, used per shard: min %u, max %u\n",
+		slots ? (double)(slots - used) / slots : 0.0, shard_min,
+		shard_max);
+	fprintf(fp, "  max probe: %u, max values per key: %u\n", probe_max,
+		count_max);
+	hash_table_hist_print(fp, "probe distance", probe_hist);
+	hash_table_hist_print(fp, "values per key", count_hist);
 }
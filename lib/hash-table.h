@@ -5,46 +5,70 @@
 #if !defined(_LIB_HASH_TABLE)
 #define _LIB_HASH_TABLE
 
-#include "list.h"
+#include <threads.h>
+#include <stdbool.h>
+#include <stdio.h>
 
-struct hash_table_entry {
-	struct list_entry list_entry;
+/*
+ * Sharded open addressing table mapping a key to the vector of values
+ * inserted with that key.  Each shard has its own lock and slot array, so
+ * concurrent inserts only contend when they land in the same shard.  A slot
+ * with a single value keeps it inline, only keys with more values allocate
+ * a vector.  A slot is free when its count is zero, so any key, including
+ * zero, can be stored.
+ */
+
+struct hash_table_slot {
 	unsigned long key;
-	void *data;
-	struct list *my_list;
+	unsigned int count;
+	unsigned int alloc;
+	union {
+		void *value;
+		void **values;
+	};
+};
+
+struct hash_table_shard {
+	mtx_t mtx;
+	unsigned int mask;
+	unsigned int used;
+	struct hash_table_slot *slots;
+	struct hash_table_slot *old_slots;
+	unsigned int old_mask;
+	unsigned int migrate_pos;
+	unsigned int grows;
+} __attribute__((aligned(64)));
+
+enum {
+	hash_table_shard_count = 64,
+	hash_table_hist_size = 16,
 };
 
 struct hash_table {
-	struct list extras;
-	unsigned int count;
-	struct list array[];
+	struct hash_table_shard shards[hash_table_shard_count];
 };
 
 struct hash_table *hash_table_init(unsigned int count);
-void hash_table_entry_init(struct hash_table_entry *hte, struct list *list,
-	unsigned long key, void *data);
+void hash_table_delete(struct hash_table *ht);
+void hash_table_settle(struct hash_table *ht);
 
-void hash_table_insert(struct hash_table *ht, unsigned int index,
-	struct hash_table_entry *hte);
-void hash_table_insert_extra(struct hash_table *ht,
-	struct hash_table_entry *hte);
-void hash_table_remove(struct hash_table_entry *hte);
+void *hash_table_insert(struct hash_table *ht, unsigned long key,
+	void *value);
+const struct hash_table_slot *hash_table_find(const struct hash_table *ht,
+	unsigned long key);
 
-struct hash_table_entry *hash_table_find_first(struct hash_table *ht,
-	unsigned int index, unsigned long key);
-struct hash_table_entry *hash_table_find_next(
-	struct hash_table_entry *hte);
+void hash_table_print_stats(const struct hash_table *ht, FILE *fp);
 
-typedef bool (*hash_table_for_each_list_cb)(void *cb_data,
-	const struct list *list);
+typedef bool (*hash_table_for_each_slot_cb)(void *cb_data,
+	const struct hash_table_slot *slot);
 
-int hash_table_for_each_list(const struct hash_table *ht,
-	hash_table_for_each_list_cb cb_fn, void *cb_data);
+int hash_table_for_each_slot(const struct hash_table *ht,
+	hash_table_for_each_slot_cb cb_fn, void *cb_data);
 
-static inline unsigned int hash_table_index(const struct hash_table *ht,
-	unsigned long key)
+static inline void *const *hash_table_slot_values(
+	const struct hash_table_slot *slot)
 {
-	return (ht->count - 1) & (unsigned int)key;
+	return (slot->count == 1) ? &slot->value : slot->values;
 }
 
 #endif /* _LIB_HASH_TABLE */
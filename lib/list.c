@@ -117,6 +117,29 @@ exit:
 	return le;
 }
 
+struct list_entry *list_pop_first(struct list *list)
+{
+	struct list_entry *le;
+
+	list_debug("%p %p\n", list, &list->mtx);
+
+	list_lock(&list->mtx);
+
+	if (list->head.next == &list->head) {
+		list_debug("NULL\n");
+		le = NULL;
+		goto exit;
+	}
+
+	le = list->head.next;
+	le->next->prev = le->prev;
+	le->prev->next = le->next;
+
+exit:
+	list_unlock(&list->mtx);
+	return le;
+}
+
 unsigned int list_item_count(const struct list *list)
 {
 	unsigned int count;
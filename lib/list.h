@@ -73,6 +73,7 @@ void list_insert_before(struct list_entry *next, struct list_entry *le);
 void list_insert_after(struct list_entry *prev, struct list_entry *le);
 
 struct list_entry *list_get_first(struct list *list);
+struct list_entry *list_pop_first(struct list *list);
 void list_remove(struct list_entry *le);
 
 unsigned int list_item_count(const struct list *list);
@@ -5,6 +5,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
+#include <threads.h>
 
 #include "log.h"
 #include "mem.h"
@@ -99,6 +100,44 @@ void __attribute__ ((unused)) _mem_free_debug(void *p, const char *func,
 	_mem_free(p);
 }
 
+/*
+ * For objects with cache line aligned members, which the header of
+ * mem_alloc() would misalign.  Must be freed with mem_free_aligned().
+ */
+
+void *mem_alloc_aligned_zero(size_t align, size_t size)
+{
+	void *p;
+	int result;
+
+	if (size == 0) {
+		log("ERROR: Zero size alloc.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	result = posix_memalign(&p, align, size);
+
+	if (result) {
+		log("ERROR: posix_memalign %lu failed: %s.\n",
+			(unsigned long)size, strerror(result));
+		exit(EXIT_FAILURE);
+	}
+
+	memset(p, 0, size);
+	return p;
+}
+
+void mem_free_aligned(void *p)
+{
+	if (!p) {
+		log("ERROR: null free.\n");
+		assert(0);
+		exit(EXIT_FAILURE);
+	}
+
+	free(p);
+}
+
 char *mem_strdup(const char *str1)
 {
 	size_t len1;
@@ -125,3 +164,197 @@ char *mem_strdupcat(const char *str1, const char *str2)
 
 	return new;
 }
+
+enum {
+	mem_arena_max = 8,
+	mem_arena_chunk_size = 1024 * 1024,
+	mem_arena_align = 8,
+};
+
+#if defined (DEBUG_MEM)
+static const unsigned int mem_arena_magic = 0xa6e0a1U;
+static const size_t mem_arena_header_size = sizeof(struct mem_header);
+#else
+static const size_t mem_arena_header_size = 0;
+#endif
+
+struct mem_arena_chunk {
+	struct mem_arena_chunk *next;
+	char data[] __attribute__((aligned(mem_arena_align)));
+};
+
+struct mem_arena {
+	mtx_t mtx;
+	const char *name;
+	unsigned int id;
+	unsigned long gen;
+	unsigned long chunk_count;
+	struct mem_arena_chunk *chunks;
+};
+
+/*
+ * The current chunk of each thread, per arena.  A chunk left over from
+ * before a release has an old gen and is not used.
+ */
+
+struct mem_arena_tls {
+	unsigned long gen;
+	char *pos;
+	char *end;
+};
+
+static __thread struct mem_arena_tls mem_arena_tls[mem_arena_max];
+static unsigned int mem_arena_ids;
+
+struct mem_arena *mem_arena_init(const char *name)
+{
+	struct mem_arena *arena;
+	unsigned int id;
+
+	id = __atomic_fetch_add(&mem_arena_ids, 1, __ATOMIC_RELAXED);
+
+	if (id >= mem_arena_max) {
+		log("ERROR: Too many arenas.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	arena = mem_alloc_zero(sizeof(*arena));
+
+	if (mtx_init(&arena->mtx, mtx_plain)) {
+		log("ERROR: mtx_init failed.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	arena->name = name;
+	arena->id = id;
+	arena->gen = 1;
+
+	return arena;
+}
+
+static char *mem_arena_chunk_alloc(struct mem_arena *arena, size_t size)
+{
+	struct mem_arena_chunk *chunk;
+
+	chunk = mem_alloc(sizeof(*chunk) + size);
+
+	mtx_lock(&arena->mtx);
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	arena->chunk_count++;
+	mtx_unlock(&arena->mtx);
+
+	return chunk->data;
+}
+
+void *mem_arena_alloc(struct mem_arena *arena, size_t size)
+{
+	struct mem_arena_tls *tls = &mem_arena_tls[arena->id];
+	unsigned long gen = __atomic_load_n(&arena->gen, __ATOMIC_RELAXED);
+	size_t len;
+	char *p;
+
+	if (size == 0) {
+		log("ERROR: Zero size alloc.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	len = (mem_arena_header_size + size + mem_arena_align - 1)
+		& ~(size_t)(mem_arena_align - 1);
+
+	if (len > mem_arena_chunk_size / 4) {
+		p = mem_arena_chunk_alloc(arena, len);
+	} else {
+		if (tls->gen != gen || (size_t)(tls->end - tls->pos) < len) {
+			tls->pos = mem_arena_chunk_alloc(arena,
+				mem_arena_chunk_size);
+			tls->end = tls->pos + mem_arena_chunk_size;
+			tls->gen = gen;
+		}
+		p = tls->pos;
+		tls->pos += len;
+	}
+
+#if defined (DEBUG_MEM)
+	{
+		struct mem_header *h = (struct mem_header *)p;
+
+		h->magic = mem_arena_magic;
+		h->size = size;
+		h->free_called = false;
+	}
+#endif
+
+	return p + mem_arena_header_size;
+}
+
+void *mem_arena_alloc_zero(struct mem_arena *arena, size_t size)
+{
+	void *p = mem_arena_alloc(arena, size);
+
+	memset(p, 0, size);
+	return p;
+}
+
+void mem_arena_free(void *p)
+{
+	if (!p) {
+		log("ERROR: null free.\n");
+		assert(0);
+		exit(EXIT_FAILURE);
+	}
+
+#if defined (DEBUG_MEM)
+	{
+		struct mem_header *h = p - sizeof(struct mem_header);
+
+		mem_debug("h=%p, p=%p\n", h, p);
+
+		if (h->magic != mem_arena_magic) {
+			log("ERROR: bad arena object.\n");
+			assert(0);
+			exit(EXIT_FAILURE);
+		}
+
+		if (h->free_called) {
+			log("ERROR: double free.\n");
+			assert(0);
+			exit(EXIT_FAILURE);
+		}
+
+		h->free_called = true;
+		memset(p, 0xcd, h->size);
+	}
+#endif
+}
+
+/*
+ * Free every chunk of the arena.  The caller must make sure no thread is
+ * still allocating from the arena or using its objects.
+ */
+
+void mem_arena_release(struct mem_arena *arena)
+{
+	struct mem_arena_chunk *chunk;
+
+	mtx_lock(&arena->mtx);
+
+	mem_debug("'%s': %lu chunks\n", arena->name, arena->chunk_count);
+
+	while ((chunk = arena->chunks)) {
+		arena->chunks = chunk->next;
+		mem_free(chunk);
+	}
+
+	arena->chunk_count = 0;
+	__atomic_add_fetch(&arena->gen, 1, __ATOMIC_RELAXED);
+
+	mtx_unlock(&arena->mtx);
+}
+
+void mem_arena_delete(struct mem_arena *arena)
+{
+	mem_arena_release(arena);
+	mtx_destroy(&arena->mtx);
+	mem_free(arena);
+}
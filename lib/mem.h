@@ -19,7 +19,27 @@ void *mem_alloc_zero(size_t size);
 void _mem_free_debug(void *p, const char *func, int line);
 void _mem_free(void *p);
 
+void *mem_alloc_aligned_zero(size_t align, size_t size);
+void mem_free_aligned(void *p);
+
 char *mem_strdup(const char *str);
 char *mem_strdupcat(const char *str1, const char *str2);
 
+/*
+ * Arena for many small objects that all die at the same time.  Each thread
+ * carves its allocations from its own chunk without locking.
+ * mem_arena_free() does nothing but check the object under DEBUG_MEM, the
+ * memory is only returned by mem_arena_release(), once no thread is using
+ * the arena.
+ */
+
+struct mem_arena;
+
+struct mem_arena *mem_arena_init(const char *name);
+void mem_arena_delete(struct mem_arena *arena);
+void *mem_arena_alloc(struct mem_arena *arena, size_t size);
+void *mem_arena_alloc_zero(struct mem_arena *arena, size_t size);
+void mem_arena_free(void *p);
+void mem_arena_release(struct mem_arena *arena);
+
 #endif /* _LIB_MEM_H */
@@ -21,23 +21,12 @@
 #include "log.h"
 #include "mmap.h"
 
-void mapped_file_map(struct mapped_file_info *mfi, const char *file)
+static void mapped_file_map_common(struct mapped_file_info *mfi,
+	const char *file)
 {
 	struct stat stat;
 	int result;
 
-	//debug("start:  '%s'\n", file);
-
-	memset(mfi, 0, sizeof(*mfi));
-
-	mfi->fd = open(file, O_RDONLY);
-
-	if (mfi->fd < 0) {
-		log("ERROR: open '%s' failed: %s\n", file, strerror(errno));
-		assert(0);
-		exit(EXIT_FAILURE);
-	}
-
 	result = fstat(mfi->fd, &stat);
 
 	if (result < 0) {
@@ -58,10 +47,45 @@ void mapped_file_map(struct mapped_file_info *mfi, const char *file)
 	debug("mapped: '%s', %lu bytes\n", file, (unsigned long)mfi->size);
 }
 
+void mapped_file_map(struct mapped_file_info *mfi, const char *file)
+{
+	//debug("start:  '%s'\n", file);
+
+	memset(mfi, 0, sizeof(*mfi));
+
+	mfi->fd = open(file, O_RDONLY);
+
+	if (mfi->fd < 0) {
+		log("ERROR: open '%s' failed: %s\n", file, strerror(errno));
+		assert(0);
+		exit(EXIT_FAILURE);
+	}
+
+	mapped_file_map_common(mfi, file);
+}
+
+/*
+ * Map an already open file.  The fd stays owned by the caller and is not
+ * closed by mapped_file_unmap().
+ */
+
+void mapped_file_map_fd(struct mapped_file_info *mfi, int fd,
+	const char *file)
+{
+	memset(mfi, 0, sizeof(*mfi));
+
+	mfi->fd = fd;
+	mapped_file_map_common(mfi, file);
+	mfi->fd = -1;
+}
+
 void mapped_file_unmap(struct mapped_file_info *mfi)
 {
 	//debug("\n");
 	munmap(mfi->addr, mfi->size);
-	close(mfi->fd);
+
+	if (mfi->fd >= 0) {
+		close(mfi->fd);
+	}
 	memset(mfi, 0xbc, sizeof(*mfi));
 }
@@ -12,6 +12,8 @@ struct mapped_file_info {
 };
 
 void mapped_file_map(struct mapped_file_info *mfi, const char *file);
+void mapped_file_map_fd(struct mapped_file_info *mfi, int fd,
+	const char *file);
 void mapped_file_unmap(struct mapped_file_info *mfi);
 
 #endif /* _LIB_MAP_H */
@@ -11,7 +11,6 @@
 #include <unistd.h>
 
 #include "log.h"
-#include "mem.h"
 #include "util.h"
 
 unsigned int to_unsigned(const char *str)
@@ -72,29 +71,6 @@ bool test_for_dots(const char *d_name)
 		&& (d_name[1] == 0 || (d_name[1] == '.' && d_name[2] == 0)));
 }
 
-char *make_sub_path(const char *parent_path, unsigned int parent_len,
-	const char *sub_name)
-{
-	unsigned int sub_len;
-	char *sub_path;
-
-	sub_len = strlen(sub_name);
-	sub_path = mem_alloc(parent_len + sub_len + 2);
-
-	//memset(sub_path, '*', parent_len + sub_len + 2);
-	//sub_path[parent_len + sub_len + 1] = 0;
-	//debug("@%s@\n", sub_path);
-
-	memcpy(sub_path, parent_path, parent_len);
-	//debug("@%s@\n", sub_path);
-	sub_path[parent_len] = '/';
-	//debug("@%s@\n", sub_path);
-	memcpy(sub_path + parent_len + 1, sub_name, sub_len + 1);
-	//debug("@%s@\n", sub_path);
-
-	return sub_path;
-}
-
 void check_exists(const char *file)
 {
 	if (access(file, R_OK)) {
@@ -1,4 +1,7 @@
 #include <assert.h>
+#include <semaphore.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "work-queue.h"
@@ -13,11 +16,231 @@
 # define wq_debug(_args...) while(0) {_debug(__func__, __LINE__, _args);}
 #endif
 
-static void work_queue_run(__attribute__ ((unused)) unsigned int id,
-	struct work_queue *wq)
+static const unsigned int work_deque_init_size = 64;
+static const unsigned long work_ring_size = 4096;
+
+/* The work queue and deque of the current worker thread. */
+static __thread struct work_queue *wq_self;
+static __thread unsigned int wq_self_id;
+
+static void work_deque_init(struct work_deque *wd)
+{
+	int result;
+
+	result = mtx_init(&wd->mtx, mtx_plain);
+
+	if (result) {
+		on_error("mtx_init.\n");
+	}
+
+	wd->head = 0;
+	wd->tail = 0;
+	wd->size = work_deque_init_size;
+	wd->items = mem_alloc(wd->size * sizeof(wd->items[0]));
+}
+
+static void work_deque_delete(struct work_deque *wd)
+{
+	assert(wd->head == wd->tail);
+
+	mem_free(wd->items);
+	mtx_destroy(&wd->mtx);
+}
+
+static bool work_deque_is_empty(const struct work_deque *wd)
+{
+	return __atomic_load_n(&wd->head, __ATOMIC_RELAXED)
+		== __atomic_load_n(&wd->tail, __ATOMIC_RELAXED);
+}
+
+static void work_deque_grow(struct work_deque *wd)
+{
+	struct work_item **items;
+	unsigned int count = wd->tail - wd->head;
+	unsigned int i;
+
+	items = mem_alloc(2 * wd->size * sizeof(items[0]));
+
+	for (i = 0; i < count; i++) {
+		items[i] = wd->items[(wd->head + i) & (wd->size - 1)];
+	}
+
+	mem_free(wd->items);
+
+	wd->items = items;
+	wd->size *= 2;
+	wd->head = 0;
+	wd->tail = count;
+}
+
+static void work_deque_push(struct work_deque *wd, struct work_item *wi)
+{
+	list_lock(&wd->mtx);
+
+	if (wd->tail - wd->head == wd->size) {
+		work_deque_grow(wd);
+	}
+
+	wd->items[wd->tail & (wd->size - 1)] = wi;
+	__atomic_store_n(&wd->tail, wd->tail + 1, __ATOMIC_RELAXED);
+
+	list_unlock(&wd->mtx);
+}
+
+static struct work_item *work_deque_pop(struct work_deque *wd)
+{
+	struct work_item *wi = NULL;
+
+	if (work_deque_is_empty(wd)) {
+		return NULL;
+	}
+
+	list_lock(&wd->mtx);
+
+	if (wd->tail != wd->head) {
+		__atomic_store_n(&wd->tail, wd->tail - 1, __ATOMIC_RELAXED);
+		wi = wd->items[wd->tail & (wd->size - 1)];
+	}
+
+	list_unlock(&wd->mtx);
+	return wi;
+}
+
+static struct work_item *work_deque_steal(struct work_deque *wd)
+{
+	struct work_item *wi = NULL;
+
+	if (work_deque_is_empty(wd)) {
+		return NULL;
+	}
+
+	list_lock(&wd->mtx);
+
+	if (wd->tail != wd->head) {
+		wi = wd->items[wd->head & (wd->size - 1)];
+		__atomic_store_n(&wd->head, wd->head + 1, __ATOMIC_RELAXED);
+	}
+
+	list_unlock(&wd->mtx);
+	return wi;
+}
+
+static void work_ring_init(struct work_ring *wr, unsigned long size)
+{
+	unsigned long i;
+
+	assert(size && !(size & (size - 1)));
+
+	wr->cells = mem_alloc(size * sizeof(wr->cells[0]));
+	wr->mask = size - 1;
+	wr->head = 0;
+	wr->tail = 0;
+
+	for (i = 0; i < size; i++) {
+		wr->cells[i].seq = i;
+	}
+}
+
+static void work_ring_delete(struct work_ring *wr)
+{
+	mem_free(wr->cells);
+}
+
+/* Returns false when the ring is full. */
+
+static bool work_ring_push(struct work_ring *wr, struct work_item *wi)
+{
+	struct work_ring_cell *cell;
+	unsigned long pos;
+
+	pos = __atomic_load_n(&wr->tail, __ATOMIC_RELAXED);
+
+	while (1) {
+		unsigned long seq;
+		long diff;
+
+		cell = &wr->cells[pos & wr->mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)pos;
+
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&wr->tail, &pos,
+				pos + 1, true, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = __atomic_load_n(&wr->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	cell->wi = wi;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* Returns NULL when the ring is empty. */
+
+static struct work_item *work_ring_pop(struct work_ring *wr)
+{
+	struct work_ring_cell *cell;
+	struct work_item *wi;
+	unsigned long pos;
+
+	pos = __atomic_load_n(&wr->head, __ATOMIC_RELAXED);
+
+	while (1) {
+		unsigned long seq;
+		long diff;
+
+		cell = &wr->cells[pos & wr->mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)(pos + 1);
+
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&wr->head, &pos,
+				pos + 1, true, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&wr->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	wi = cell->wi;
+	__atomic_store_n(&cell->seq, pos + wr->mask + 1, __ATOMIC_RELEASE);
+	return wi;
+}
+
+/*
+ * Drop one outstanding item.  The waiter in work_queue_wait() checks the
+ * count under done_mtx, so taking it here before the broadcast is enough to
+ * make sure the last completion is never missed.
+ */
+
+static void work_queue_put_outstanding(struct work_queue *wq)
+{
+	if (__atomic_sub_fetch(&wq->outstanding, 1, __ATOMIC_SEQ_CST)) {
+		return;
+	}
+
+	list_lock(&wq->done_mtx);
+	cnd_broadcast(&wq->done_cnd);
+	list_unlock(&wq->done_mtx);
+}
+
+static void work_queue_run(unsigned int id, struct work_queue *wq)
 {
 	struct work_item *wi;
 
+	wq_self = wq;
+	wq_self_id = id;
+
 	wq_debug("th%u: wait work\n", id);
 
 	wi = work_queue_get_item(wq);
@@ -32,30 +255,61 @@ static void work_queue_run(__attribute__ ((unused)) unsigned int id,
 	assert(wi->cb);
 
 	wi->cb(wi); // cb takes ownership of wi.
+
+	work_queue_put_outstanding(wq);
 }
 
 void work_queue_init(struct work_queue *wq, unsigned int thread_count)
 {
+	unsigned int i;
 	int result;
 
-	result = sem_init(&wq->work_ready, 0, 0);
+	result = mtx_init(&wq->idle_mtx, mtx_plain);
 
 	if (result) {
-		on_error("sem_init.\n");
+		on_error("mtx_init.\n");
 	}
 
-	wq->thread_pool = thread_pool_init(thread_count,
-		(thread_pool_run_fn)work_queue_run, wq);
-	
+	result = cnd_init(&wq->idle_cnd);
+
+	if (result) {
+		on_error("cnd_init.\n");
+	}
+
+	result = mtx_init(&wq->done_mtx, mtx_plain);
+
+	if (result) {
+		on_error("mtx_init.\n");
+	}
+
+	result = cnd_init(&wq->done_cnd);
+
+	if (result) {
+		on_error("cnd_init.\n");
+	}
+
+	work_ring_init(&wq->ready_ring, work_ring_size);
 	list_init(&wq->ready_list, "work queue ready_list");
 	list_init(&wq->done_list, "work queue done_list");
+
+	wq->deque_count = thread_count;
+	wq->deques = mem_alloc_zero(thread_count * sizeof(wq->deques[0]));
+
+	for (i = 0; i < thread_count; i++) {
+		work_deque_init(&wq->deques[i]);
+	}
+
+	__sync_synchronize();
+
+	wq->thread_pool = thread_pool_init(thread_count,
+		(thread_pool_run_fn)work_queue_run, wq);
 }
 
 struct work_queue *work_queue_alloc(unsigned int thread_count)
 {
 	struct work_queue *wq;
 
-	wq = mem_alloc_zero(sizeof(*wq));
+	wq = mem_alloc_aligned_zero(__alignof__(*wq), sizeof(*wq));
 	work_queue_init(wq, thread_count);
 
 	return wq;
@@ -63,7 +317,6 @@ struct work_queue *work_queue_alloc(unsigned int thread_count)
 
 void work_queue_exit(struct work_queue *wq)
 {
-	unsigned int i;
 	struct work_item *wi;
 
 	list_for_each(&wq->ready_list, wi, list_entry) {
@@ -72,84 +325,202 @@ void work_queue_exit(struct work_queue *wq)
 
 	thread_pool_exit(wq->thread_pool);
 
+	list_lock(&wq->idle_mtx);
 	wq->exit = 1;
 	__sync_synchronize();
-
-	for (i = 0; i < wq->thread_pool->count; i++) {
-		sem_post(&wq->work_ready);
-	}
+	cnd_broadcast(&wq->idle_cnd);
+	list_unlock(&wq->idle_mtx);
 }
 
 void work_queue_delete(struct work_queue *wq)
 {
+	unsigned int i;
+
 	wq_debug(">\n");
 
 	work_queue_exit(wq);
 	thread_pool_delete(wq->thread_pool);
-	mem_free(wq);
+
+	for (i = 0; i < wq->deque_count; i++) {
+		work_deque_delete(&wq->deques[i]);
+	}
+	mem_free(wq->deques);
+	work_ring_delete(&wq->ready_ring);
+
+	cnd_destroy(&wq->done_cnd);
+	mtx_destroy(&wq->done_mtx);
+	cnd_destroy(&wq->idle_cnd);
+	mtx_destroy(&wq->idle_mtx);
+	mem_free_aligned(wq);
 
 	wq_debug("<\n");
 }
 
+/*
+ * Items added by a worker thread go onto that thread's own deque, items
+ * added from any other thread go onto the shared ready_ring, or the
+ * ready_list when the ring is full.
+ */
+
 void work_queue_add_item(struct work_queue *wq, struct work_item *wi)
 {
 	wi->wq = wq;
 
-	list_entry_init(&wq->ready_list, &wi->list_entry);
-	list_add_tail(&wq->ready_list, &wi->list_entry);
+	__atomic_add_fetch(&wq->outstanding, 1, __ATOMIC_SEQ_CST);
 
-	__sync_synchronize();
+	if (wq_self == wq) {
+		work_deque_push(&wq->deques[wq_self_id], wi);
+	} else if (!work_ring_push(&wq->ready_ring, wi)) {
+		list_add_tail(&wq->ready_list, &wi->list_entry);
+		__atomic_add_fetch(&wq->overflow, 1, __ATOMIC_SEQ_CST);
+	}
+
+	__atomic_add_fetch(&wq->pending, 1, __ATOMIC_SEQ_CST);
 
 	wq_debug("wi%u added\n", wi->id);
-	sem_post(&wq->work_ready);
+
+	if (__atomic_load_n(&wq->idle_count, __ATOMIC_SEQ_CST)) {
+		list_lock(&wq->idle_mtx);
+		cnd_signal(&wq->idle_cnd);
+		list_unlock(&wq->idle_mtx);
+	}
 }
 
-struct work_item *work_queue_get_item(struct work_queue *wq)
+static struct work_item *work_queue_try_get_item(struct work_queue *wq)
 {
 	struct list_entry *le;
 	struct work_item *wi;
+	unsigned int i;
 
-	sem_wait(&wq->work_ready);
-	
-	if (wq->exit) {
-		wq_debug("got wq exit\n");
-		return NULL;
+	if (wq_self == wq) {
+		wi = work_deque_pop(&wq->deques[wq_self_id]);
+
+		if (wi) {
+			return wi;
+		}
 	}
 
-	le = list_get_first(&wq->ready_list);
+	wi = work_ring_pop(&wq->ready_ring);
 
-	if (!le) {
-		on_error("ready_list empty.\n");
+	if (wi) {
+		return wi;
 	}
-	
-	wi = list_entry(le, struct work_item, list_entry, &wq->ready_list);
 
-	return wi;
+	le = __atomic_load_n(&wq->overflow, __ATOMIC_SEQ_CST)
+		? list_pop_first(&wq->ready_list) : NULL;
+
+	if (le) {
+		__atomic_sub_fetch(&wq->overflow, 1, __ATOMIC_SEQ_CST);
+		return list_entry(le, struct work_item, list_entry,
+			&wq->ready_list);
+	}
+
+	for (i = 1; i <= wq->deque_count; i++) {
+		unsigned int victim = (wq_self_id + i) % wq->deque_count;
+
+		wi = work_deque_steal(&wq->deques[victim]);
+
+		if (wi) {
+			wq_debug("th%u: stole wi%u from th%u\n", wq_self_id,
+				wi->id, victim);
+			return wi;
+		}
+	}
+
+	return NULL;
 }
 
-void work_queue_finish_item(struct work_item *wi)
+/*
+ * Take the next item: first from our own deque, then from the shared
+ * ready_ring and ready_list, then by stealing from the other workers.
+ * Sleeps only when there is no pending work anywhere.
+ */
+
+struct work_item *work_queue_get_item(struct work_queue *wq)
 {
-	struct work_queue *wq = wi->wq;
+	struct work_item *wi;
+
+	while (1) {
+		if (wq->exit) {
+			wq_debug("got wq exit\n");
+			return NULL;
+		}
+
+		wi = work_queue_try_get_item(wq);
 
-	assert(wi->list_entry.in_use);
+		if (wi) {
+			__atomic_sub_fetch(&wq->pending, 1, __ATOMIC_SEQ_CST);
+			return wi;
+		}
+
+		list_lock(&wq->idle_mtx);
+		__atomic_add_fetch(&wq->idle_count, 1, __ATOMIC_SEQ_CST);
+
+		while (!wq->exit
+			&& !__atomic_load_n(&wq->pending, __ATOMIC_SEQ_CST)) {
+			cnd_wait(&wq->idle_cnd, &wq->idle_mtx);
+		}
+
+		__atomic_sub_fetch(&wq->idle_count, 1, __ATOMIC_SEQ_CST);
+		list_unlock(&wq->idle_mtx);
+	}
+}
 
-	list_remove(&wi->list_entry);
+void work_queue_finish_item(struct work_item *wi)
+{
+	struct work_queue *wq = wi->wq;
 
 	list_add_tail(&wq->done_list, &wi->list_entry);
 	__sync_synchronize();
 }
 
+/*
+ * Wait until every added item has finished or timeout_ms has passed.
+ * Returns true when the queue is idle.  Signal handlers cannot safely
+ * wake a condvar, so callers that need to react to signals pass a short
+ * timeout and check for them between calls.
+ */
+
+bool work_queue_wait(struct work_queue *wq, unsigned int timeout_ms)
+{
+	struct timespec ts;
+	bool idle;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	list_lock(&wq->done_mtx);
+
+	while (!(idle = !work_queue_is_busy(wq))) {
+		if (cnd_timedwait(&wq->done_cnd, &wq->done_mtx, &ts)
+			== thrd_timedout) {
+			idle = !work_queue_is_busy(wq);
+			break;
+		}
+	}
+
+	list_unlock(&wq->done_mtx);
+
+	return idle;
+}
+
 void work_queue_empty_ready_list(struct work_queue *wq)
 {
-	struct work_item *wi_safe;
 	struct work_item *wi;
 
-	if (!list_is_empty(&wq->ready_list)) {
-		debug("ready_list not empty.\n");
+	if (work_queue_is_busy(wq)) {
+		debug("work queue not empty.\n");
 	}
 
-	list_for_each_safe(&wq->ready_list, wi, wi_safe, list_entry) {
-		list_remove(&wi->list_entry);
+	while ((wi = work_queue_try_get_item(wq))) {
+		__atomic_sub_fetch(&wq->pending, 1, __ATOMIC_SEQ_CST);
+		work_queue_put_outstanding(wq);
 		mem_free(wi);
 	}
 
@@ -158,6 +529,113 @@ void work_queue_empty_ready_list(struct work_queue *wq)
 	}
 }
 
+/*
+ * A parallel for loop run by the calling worker together with helper items
+ * queued on the same work queue.  Indices are claimed with an atomic counter,
+ * so the caller keeps working instead of blocking and the loop completes even
+ * if no helper ever runs.  Helpers that start after all indices are claimed
+ * just drop their reference to the job.
+ */
+
+struct work_queue_job {
+	void (*fn)(void *arg, unsigned int index);
+	void *arg;
+	unsigned int count;
+	unsigned int next;
+	unsigned int done;
+	unsigned int refs;
+	mtx_t mtx;
+	cnd_t cnd;
+};
+
+static void work_queue_job_run(struct work_queue_job *job)
+{
+	unsigned int index;
+
+	while ((index = __atomic_fetch_add(&job->next, 1, __ATOMIC_SEQ_CST))
+		< job->count) {
+		job->fn(job->arg, index);
+
+		if (__atomic_add_fetch(&job->done, 1, __ATOMIC_SEQ_CST)
+			== job->count) {
+			list_lock(&job->mtx);
+			cnd_broadcast(&job->cnd);
+			list_unlock(&job->mtx);
+		}
+	}
+}
+
+static void work_queue_job_put(struct work_queue_job *job)
+{
+	if (__atomic_sub_fetch(&job->refs, 1, __ATOMIC_SEQ_CST)) {
+		return;
+	}
+
+	cnd_destroy(&job->cnd);
+	mtx_destroy(&job->mtx);
+	mem_free(job);
+}
+
+static int work_queue_job_cb(struct work_item *wi)
+{
+	struct work_queue_job *job = wi->cb_data;
+
+	work_queue_job_run(job);
+	work_queue_job_put(job);
+	mem_free(wi);
+	return 0;
+}
+
+void work_queue_parallel_for(unsigned int count,
+	void (*fn)(void *arg, unsigned int index), void *arg)
+{
+	struct work_queue *wq = wq_self;
+	struct work_queue_job *job;
+	unsigned int helpers = 0;
+	unsigned int i;
+
+	if (wq && count > 1) {
+		helpers = count - 1 < wq->deque_count - 1
+			? count - 1 : wq->deque_count - 1;
+	}
+
+	if (!helpers) {
+		for (i = 0; i < count; i++) {
+			fn(arg, i);
+		}
+		return;
+	}
+
+	job = mem_alloc_zero(sizeof(*job));
+	job->fn = fn;
+	job->arg = arg;
+	job->count = count;
+	job->refs = helpers + 1;
+
+	if (mtx_init(&job->mtx, mtx_plain) || cnd_init(&job->cnd)) {
+		on_error("job init.\n");
+	}
+
+	for (i = 0; i < helpers; i++) {
+		struct work_item *wi = mem_alloc_zero(sizeof(*wi));
+
+		wi->id = i;
+		wi->cb = work_queue_job_cb;
+		wi->cb_data = job;
+		work_queue_add_item(wq, wi);
+	}
+
+	work_queue_job_run(job);
+
+	list_lock(&job->mtx);
+	while (__atomic_load_n(&job->done, __ATOMIC_SEQ_CST) < count) {
+		cnd_wait(&job->cnd, &job->mtx);
+	}
+	list_unlock(&job->mtx);
+
+	work_queue_job_put(job);
+}
+
 #define test_threads 9
 #define test_items 28
 
@@ -212,7 +690,7 @@ void __attribute__ ((unused)) work_queue_test(void)
 	}
 
 	i = 1;
-	while (!list_is_empty(&wq->ready_list)) {
+	while (work_queue_is_busy(wq)) {
 		wq_debug("waiting for work to finish: %u\n", i++);
 		sleep(1);
 	}
@@ -228,3 +706,165 @@ void __attribute__ ((unused)) work_queue_test(void)
 	wq_debug("<\n");
 }
 
+#define bench_threads 4
+#define bench_items (1024 * 1024)
+
+#define bench_work_loops 200
+
+/*
+ * Throughput of the shared ready queue in isolation, with bench_threads
+ * producers and consumers: the old semaphore counted list against the
+ * lock-free ring.  As in the old queue, a list consumer waits on the
+ * semaphore, marks the first free item in_use with list_get_first(), runs the
+ * item and only then removes it, so other consumers walk past the items in
+ * flight.  Each item runs bench_work_loops of busy work.
+ *
+ * Only threads outside the pool add to the ring in a real run, items added by
+ * workers go to their own deques, so this does not measure a whole run.
+ */
+
+struct work_queue_bench_data {
+	bool use_ring;
+	struct work_ring ring;
+	sem_t sem;
+	struct list list;
+	struct work_item *items;
+	unsigned int next;
+	unsigned long remaining;
+};
+
+static void work_queue_bench_work(void)
+{
+	volatile unsigned int loops;
+
+	for (loops = 0; loops < bench_work_loops; loops++) {
+	}
+}
+
+static int work_queue_bench_producer(void *arg)
+{
+	struct work_queue_bench_data *bd = arg;
+	unsigned int i;
+
+	while ((i = __atomic_fetch_add(&bd->next, 1, __ATOMIC_RELAXED))
+		< bench_items) {
+		struct work_item *wi = &bd->items[i];
+
+		if (bd->use_ring) {
+			while (!work_ring_push(&bd->ring, wi)) {
+				thrd_yield();
+			}
+		} else {
+			list_add_tail(&bd->list, &wi->list_entry);
+			sem_post(&bd->sem);
+		}
+	}
+	return 0;
+}
+
+/*
+ * The list consumer taking the last item posts the semaphore once for each
+ * other consumer so they see remaining is zero and stop.
+ */
+
+static int work_queue_bench_consumer(void *arg)
+{
+	struct work_queue_bench_data *bd = arg;
+	struct list_entry *le;
+	unsigned int i;
+
+	if (!bd->use_ring) {
+		while (1) {
+			sem_wait(&bd->sem);
+
+			if (!__atomic_load_n(&bd->remaining, __ATOMIC_SEQ_CST)) {
+				return 0;
+			}
+
+			le = list_get_first(&bd->list);
+			work_queue_bench_work();
+			list_remove(le);
+
+			if (!__atomic_sub_fetch(&bd->remaining, 1,
+				__ATOMIC_SEQ_CST)) {
+				for (i = 1; i < bench_threads; i++) {
+					sem_post(&bd->sem);
+				}
+				return 0;
+			}
+		}
+	}
+
+	while (__atomic_load_n(&bd->remaining, __ATOMIC_RELAXED)) {
+		if (work_ring_pop(&bd->ring)) {
+			work_queue_bench_work();
+			__atomic_sub_fetch(&bd->remaining, 1, __ATOMIC_RELAXED);
+		} else {
+			thrd_yield();
+		}
+	}
+	return 0;
+}
+
+static double work_queue_bench_run(struct work_queue_bench_data *bd)
+{
+	thrd_t threads[2 * bench_threads];
+	struct timespec start;
+	struct timespec end;
+	unsigned int i;
+
+	bd->next = 0;
+	bd->remaining = bench_items;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < 2 * bench_threads; i++) {
+		if (thrd_create(&threads[i], (i < bench_threads)
+			? work_queue_bench_producer : work_queue_bench_consumer,
+			bd) != thrd_success) {
+			on_error("thrd_create.\n");
+		}
+	}
+
+	for (i = 0; i < 2 * bench_threads; i++) {
+		thrd_join(threads[i], NULL);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)
+		/ 1e9;
+}
+
+void __attribute__ ((unused)) work_queue_bench(void)
+{
+	struct work_queue_bench_data bd;
+	double list_time;
+	double ring_time;
+
+	memset(&bd, 0, sizeof(bd));
+	bd.items = mem_alloc_zero(bench_items * sizeof(bd.items[0]));
+	list_init(&bd.list, "bench list");
+	work_ring_init(&bd.ring, work_ring_size);
+
+	if (sem_init(&bd.sem, 0, 0)) {
+		on_error("sem_init.\n");
+	}
+
+	bd.use_ring = false;
+	list_time = work_queue_bench_run(&bd);
+
+	bd.use_ring = true;
+	ring_time = work_queue_bench_run(&bd);
+
+	log("%u items, %u producers, %u consumers\n", bench_items,
+		bench_threads, bench_threads);
+	log("sem+list: %.3f s, %.2f M items/s\n", list_time,
+		bench_items / list_time / 1e6);
+	log("ring: %.3f s, %.2f M items/s\n", ring_time,
+		bench_items / ring_time / 1e6);
+
+	sem_destroy(&bd.sem);
+	work_ring_delete(&bd.ring);
+	mem_free(bd.items);
+}
@@ -1,7 +1,7 @@
 #if !defined(_LIB_WORK_QUEUE)
 #define _LIB_WORK_QUEUE
 
-#include <semaphore.h>
+#include <threads.h>
 
 #include "thread-pool.h"
 #include "list.h"
@@ -21,12 +21,53 @@ struct work_item {
 	struct work_queue *wq;
 };
 
+/*
+ * Per-thread work deque.  The owning thread pushes and pops at the tail,
+ * other threads steal from the head.
+ */
+
+struct work_deque {
+	mtx_t mtx;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int size;
+	struct work_item **items;
+};
+
+/*
+ * Bounded lock-free multi-producer multi-consumer ring, after Dmitry
+ * Vyukov's design.  Each cell's sequence number tells whether it is ready to
+ * be written or read for a given position.
+ */
+
+struct work_ring_cell {
+	unsigned long seq;
+	struct work_item *wi;
+};
+
+struct work_ring {
+	struct work_ring_cell *cells;
+	unsigned long mask;
+	unsigned long head __attribute__((aligned(64)));
+	unsigned long tail __attribute__((aligned(64)));
+};
+
 struct work_queue {
-	sem_t work_ready;
 	bool exit;
+	struct work_ring ready_ring;
 	struct list ready_list;
+	unsigned long overflow;
 	struct list done_list;
 	struct thread_pool *thread_pool;
+	unsigned int deque_count;
+	struct work_deque *deques;
+	mtx_t idle_mtx;
+	cnd_t idle_cnd;
+	unsigned int idle_count;
+	mtx_t done_mtx;
+	cnd_t done_cnd;
+	unsigned long pending;
+	unsigned long outstanding;
 };
 
 struct work_queue *work_queue_alloc(unsigned int thread_count);
@@ -37,8 +78,17 @@ void work_queue_delete(struct work_queue *wq);
 void work_queue_add_item(struct work_queue *wq, struct work_item *wi);
 struct work_item *work_queue_get_item(struct work_queue *wq);
 void work_queue_finish_item(struct work_item *wi);
+bool work_queue_wait(struct work_queue *wq, unsigned int timeout_ms);
 void work_queue_empty_ready_list(struct work_queue *wq);
+void work_queue_parallel_for(unsigned int count,
+	void (*fn)(void *arg, unsigned int index), void *arg);
+
+static inline bool work_queue_is_busy(const struct work_queue *wq)
+{
+	return __atomic_load_n(&wq->outstanding, __ATOMIC_SEQ_CST) != 0;
+}
 
 void __attribute__ ((unused)) work_queue_test(void);
+void __attribute__ ((unused)) work_queue_bench(void);
 
 #endif /* _LIB_WORK_QUEUE */
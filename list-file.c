@@ -26,24 +26,30 @@ struct list_file_data {
 	unsigned int list_entry_max;
 };
 
-static bool list_file_print_cb(void *cb_data, const struct list *list)
+static bool list_file_print_cb(void *cb_data,
+	const struct hash_table_slot *slot)
 {
 	struct list_file_data *pfl_data = cb_data;
-	struct hash_table_entry *hte;
-	unsigned int counter = 0;
+	char path[file_path_max];
+	void *const *values;
+	unsigned int i;
 
-	list_for_each(list, hte, list_entry) {
-		struct file_data *data;
+	if (!slot->key) {
+		return false;
+	}
 
-		counter++;
-		pfl_data->file_counter++;
+	values = hash_table_slot_values(slot);
 
-		data = (struct file_data *)hte->data;
-		fprintf(pfl_data->list_fp, "%lu %s\n", hte->key, data->name);
+	for (i = 0; i < slot->count; i++) {
+		const struct file_data *data = values[i];
+
+		pfl_data->file_counter++;
+		fprintf(pfl_data->list_fp, "%lu %s\n", slot->key,
+			file_data_path(data, path));
 	}
 
-	pfl_data->list_entry_max = (counter > pfl_data->list_entry_max)
-		? counter : pfl_data->list_entry_max;
+	pfl_data->list_entry_max = (slot->count > pfl_data->list_entry_max)
+		? slot->count : pfl_data->list_entry_max;
 
 	return false;
 }
@@ -77,7 +83,7 @@ bool list_file_print(const struct hash_table *ht, FILE *list_fp)
 	};
 	int result;
 
-	result = hash_table_for_each_list(ht, list_file_print_cb, &pfl_data);
+	result = hash_table_for_each_slot(ht, list_file_print_cb, &pfl_data);
 
 	if (result) {
 		return result;
@@ -22,6 +22,145 @@ on_err() {
 	exit "${err_no}"
 }
 
+# Join lines of "key<tab>path" into one line per key, paths sorted, then
+# sort the lines.
+join_groups() {
+	sort -t $'\t' -k1,1 -k2 \
+		| awk -F '\t' '$1 != k {if (NR > 1) print line; k = $1; line = $2; next} {line = line " " $2} END {if (NR) print line}' \
+		| sort
+}
+
+# Print each dupe group of a list on one line, so lists from different runs
+# compare equal.
+normalize_groups() {
+	local list=${1}
+
+	awk '/^#/ {next} /^$/ {g++; next} {sub(/^\[[0-9]+\] /, ""); print g "\t" $0}' \
+		"${list}" | join_groups
+}
+
+normalize_list() {
+	local list=${1}
+
+	grep -v -e '^#' -e '^$' "${list}" | sort || :
+}
+
+# Expected dupe groups, from md5sum of every non-empty file that has no
+# other hard link.
+expected_groups() {
+	local src=${1}
+
+	find "${src}" -type f -links 1 -size +0 -exec md5sum {} + \
+		| awk '{print $1 "\t" $2}' | join_groups | awk 'NF > 1'
+}
+
+make_test_tree() {
+	local src=${1}
+	local i
+
+	rm -rf "${src}"
+	mkdir -p "${src}/a/b/c" "${src}/d"
+
+	# Dupes larger than the prefix and suffix, three copies.
+	head -c 100000 /dev/urandom > "${src}/a/big1"
+	cp "${src}/a/big1" "${src}/d/big1.copy"
+	cp "${src}/a/big1" "${src}/a/b/c/big1.copy2"
+
+	# Same size, same prefix and suffix, differ in the middle.
+	head -c 100000 /dev/urandom > "${src}/a/mid1"
+	cp "${src}/a/mid1" "${src}/a/mid2"
+	printf 'x' | dd of="${src}/a/mid2" bs=1 seek=50000 conv=notrunc \
+		status=none
+	cp "${src}/a/mid1" "${src}/d/mid1.copy"
+
+	# Same size and prefix, differ at the end.
+	{ head -c 40000 /dev/zero; printf 'a'; } > "${src}/a/tail1"
+	{ head -c 40000 /dev/zero; printf 'b'; } > "${src}/a/tail2"
+	cp "${src}/a/tail1" "${src}/d/tail1.copy"
+
+	# A hard link with no other copy.
+	head -c 100000 /dev/urandom > "${src}/a/linked"
+	ln "${src}/a/linked" "${src}/d/linked.link"
+
+	# Small files.
+	echo hello > "${src}/a/hello1"
+	echo hello > "${src}/d/hello2"
+	echo world > "${src}/d/world"
+	for ((i = 1; i <= 60; i++)); do
+		echo "file $((i % 20))" > "${src}/a/b/f${i}"
+	done
+
+	# A size class large enough to be hashed in parallel batches.
+	mkdir -p "${src}/e"
+	for ((i = 1; i <= 100; i++)); do
+		printf 'batch %03d\n' "$((i % 40))" > "${src}/e/g${i}"
+	done
+
+	: > "${src}/a/empty1"
+	: > "${src}/d/empty2"
+}
+
+# Run find-dupes on the test tree into test-out/<name>.  Fails if the dupe
+# groups differ from the expected groups, or the unique list differs from
+# unique.ref when there is one.
+check_run() {
+	local name=${1}
+	shift
+	local out="${build_dir}/test-out/${name}"
+
+	rm -rf "${out}"
+	"${find_dupes}" --output-dir="${out}" "${@}" "${test_src}" \
+		2> "${out}.log"
+
+	normalize_groups "${out}/dupes.lst" > "${out}.groups"
+
+	# Either file of the hard link pair may be listed, whichever the scan
+	# found first.
+	normalize_list "${out}/unique.lst" \
+		| sed "s|^${test_src}/d/linked.link\$|${test_src}/a/linked|" \
+		| sort > "${out}.unique"
+
+	if ! diff -u "${build_dir}/test-out/expected.groups" "${out}.groups"; then
+		echo "${script_name}: ERROR: ${name}: dupes.lst mismatch" >&2
+		exit 1
+	fi
+
+	if [[ -f "${build_dir}/test-out/unique.ref" ]] \
+		&& ! diff -u "${build_dir}/test-out/unique.ref" "${out}.unique"; then
+		echo "${script_name}: ERROR: ${name}: unique.lst mismatch" >&2
+		exit 1
+	fi
+
+	echo "${name}: OK"
+}
+
+# Fails unless the run read no file data to compare files.
+check_no_reads() {
+	local name=${1}
+	local log="${build_dir}/test-out/${name}.log"
+
+	if ! grep -q 'Hashed 0 prefix bytes, 0 suffix bytes, 0 digest bytes' \
+		"${log}"; then
+		echo "${script_name}: ERROR: ${name}: file data read" >&2
+		cat "${log}" >&2
+		exit 1
+	fi
+	echo "${name}: no reads"
+}
+
+# Fails unless the run got its digests from the cache and read no file data.
+check_cached() {
+	local name=${1}
+	local log="${build_dir}/test-out/${name}.log"
+
+	if ! grep -q 'Digest cache: [1-9][0-9]* hits' "${log}"; then
+		echo "${script_name}: ERROR: ${name}: digests not cached" >&2
+		cat "${log}" >&2
+		exit 1
+	fi
+	check_no_reads "${name}"
+}
+
 #===============================================================================
 export PS4='\[\e[0;33m\]+ ${BASH_SOURCE##*/}:${LINENO}:(${FUNCNAME[0]:-main}):\[\e[0m\] '
 
@@ -74,6 +213,127 @@ echo ''
 echo "--- cat dupes.lst ---"
 cat "${build_dir}/test-out/dupes.lst"
 
+echo ''
+echo "--- test tree ---"
+find_dupes="${build_dir}/install/bin/find-dupes"
+test_src="${build_dir}/test-src"
+
+make_test_tree "${test_src}"
+mkdir -p "${build_dir}/test-out"
+rm -f "${build_dir}/test-out/unique.ref"
+expected_groups "${test_src}" > "${build_dir}/test-out/expected.groups"
+cat "${build_dir}/test-out/expected.groups"
+
+check_run base
+cp "${build_dir}/test-out/base.unique" "${build_dir}/test-out/unique.ref"
+
+echo ''
+echo "--- empty files ---"
+normalize_list "${build_dir}/test-out/base/empty.lst" \
+	| diff -u - <(printf '%s\n' "${test_src}/a/empty1" "${test_src}/d/empty2")
+echo "empty files: OK"
+
+echo ''
+echo "--- hard links ---"
+normalize_groups "${build_dir}/test-out/base/hard-links.lst" \
+	> "${build_dir}/test-out/base.links"
+echo "${test_src}/a/linked ${test_src}/d/linked.link" \
+	| diff -u - "${build_dir}/test-out/base.links"
+echo "hard links: OK"
+
+echo ''
+echo "--- digest types ---"
+for type in md5 mmhash xxh128 blake3 sha256 sha512-256 blake3-tree; do
+	if ! "${find_dupes}" --digest="${type}" --help > /dev/null 2>&1; then
+		echo "digest-${type}: not built, skipped"
+		continue
+	fi
+	check_run "digest-${type}" --digest="${type}"
+done
+
+echo ''
+echo "--- options ---"
+check_run prefix-0 --prefix-size=0
+check_run prefix-4 --prefix-size=4
+check_run pipeline --pipeline
+grep -q 'Hashed [1-9][0-9]* prefix bytes' "${build_dir}/test-out/pipeline.log"
+check_run pipeline-prefix-0 --pipeline --prefix-size=0
+check_run jobs-1 --jobs=1
+check_run jobs-4 --jobs=4
+check_run file-list --file-list
+check_run buckets-1 --buckets=1
+if "${find_dupes}" --output-dir="${build_dir}/test-out/buckets-bad" \
+	--buckets=4194304 "${test_src}" 2> /dev/null; then
+	echo "${script_name}: ERROR: buckets-bad: accepted" >&2
+	exit 1
+fi
+echo "buckets-bad: rejected"
+check_run bucket-stats --bucket-stats
+grep -q 'probe distance:' "${build_dir}/test-out/bucket-stats.log"
+for io in read mmap direct; do
+	check_run "hash-io-${io}" --hash-io="${io}"
+done
+
+echo ''
+echo "--- digest cache ---"
+cache="${build_dir}/test-out/digest.cache"
+rm -f "${cache}"
+check_run cache-1 --digest-cache="${cache}"
+check_run cache-2 --digest-cache="${cache}"
+check_cached cache-2
+
+# Entries for files a run does not look at are kept.
+"${find_dupes}" --output-dir="${build_dir}/test-out/cache-part" \
+	--digest-cache="${cache}" "${test_src}/a/b" \
+	2> "${build_dir}/test-out/cache-part.log"
+check_run cache-3 --digest-cache="${cache}"
+check_cached cache-3
+
+# Entries for files that are gone are pruned.
+gone_src="${build_dir}/test-gone"
+rm -rf "${gone_src}"
+mkdir -p "${gone_src}"
+echo gone > "${gone_src}/gone1"
+echo gone > "${gone_src}/gone2"
+"${find_dupes}" --output-dir="${build_dir}/test-out/cache-gone" \
+	--digest-cache="${cache}" "${gone_src}" \
+	2> "${build_dir}/test-out/cache-gone.log"
+rm "${gone_src}/gone1"
+check_run cache-pruned --digest-cache="${cache}"
+grep -q 'Digest cache: .* 1 pruned' "${build_dir}/test-out/cache-pruned.log"
+echo "cache-pruned: pruned"
+
+# Without a file, the cache goes under $XDG_CACHE_HOME.
+rm -rf "${build_dir}/test-out/xdg"
+XDG_CACHE_HOME="${build_dir}/test-out/xdg" check_run cache-default \
+	--digest-cache
+test -s "${build_dir}/test-out/xdg/clean-dupes/digest.cache"
+
+# Same size change past the prefix and suffix that keeps the mtime, so only
+# the full digest sees it and only the ctime tells the cache.
+touch -r "${test_src}/a/b/c/big1.copy2" "${build_dir}/test-out/mtime.ref"
+printf 'x' | dd of="${test_src}/a/b/c/big1.copy2" bs=1 seek=50000 \
+	conv=notrunc status=none
+touch -r "${build_dir}/test-out/mtime.ref" "${test_src}/a/b/c/big1.copy2"
+expected_groups "${test_src}" > "${build_dir}/test-out/expected.groups"
+rm -f "${build_dir}/test-out/unique.ref"
+check_run modified-base
+cp "${build_dir}/test-out/modified-base.unique" \
+	"${build_dir}/test-out/unique.ref"
+check_run cache-modified --digest-cache="${cache}"
+
+echo ''
+echo "--- digest xattr ---"
+# Writing the xattr changes the ctime, the cache must still hit next time.
+cache="${build_dir}/test-out/xattr.cache"
+rm -f "${cache}"
+check_run xattr-cache-1 --digest-xattr --digest-cache="${cache}"
+check_run xattr-cache-2 --digest-xattr --digest-cache="${cache}"
+check_cached xattr-cache-2
+check_run xattr-1 --digest-xattr
+check_run xattr-2 --digest-xattr
+check_no_reads xattr-2
+
 echo ''
 echo "--- Done ---"
 